@@ -10,6 +10,10 @@
 
 #include<sys/ioctl.h>
 #include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<sys/uio.h>
+#include<poll.h>
 #include<unistd.h>
 #include<termios.h>
 #include<stdlib.h>
@@ -18,13 +22,30 @@
 #include<stdio.h>
 #include<errno.h>
 #include<string.h>
+#include<limits.h>
+#include<stdint.h>
 #include<time.h>
 #include<fcntl.h>
+#include<dirent.h>
+#include<pthread.h>
+#include<signal.h>
+#include<regex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#endif
 
 #define CTRL_KEY(k)  ((k) & 0x1f)
 #define SMEDITOR_VERSION "Alpha-0.0.1"
 #define SMEDITOR_TAB_STOP 8
 #define SMEDITOR_QUIT_TIMES 1;
+#define RENDER_CACHE_MIN_SLOTS 256
+#define RENDER_CACHE_BUDGET (8 << 20) //bytes of rendered cells kept off screen
+#define RENDER_WINDOW_MIN (16 << 10) //longer rows only render the columns on screen
+#define RENDER_WINDOW_MARGIN 512 //columns rendered on each side of the screen
+#define SMEDITOR_STATUS_SECS 5 //how long a status message stays up
+#define SMEDITOR_FPS 60 //default cap on frames per second, see SMEDITOR_FPS env
+#define SMEDITOR_UNDO_MB 64 //default memory kept for undo, see SMEDITOR_UNDO_MB env
+#define SMEDITOR_CACHE_MB 1024 //default size of the line index cache, see SMEDITOR_CACHE_MB env
 
 enum editorKey {
     BACKSPACE = 127, //ASCII value
@@ -36,29 +57,485 @@ enum editorKey {
     PAGE_DOWN,
     HOME_KEY, // Home key could be sent as <esc>[1~, <esc>[7~, <esc>[H, or <esc>OH
     END_KEY, //the End key could be sent as <esc>[4~, <esc>[8~, <esc>[F, or <esc>OF
-    DEL_KEY // sends the escape sequence <esc>[3~
+    DEL_KEY, // sends the escape sequence <esc>[3~
+    PASTE_KEY // a bracketed paste, see inputReadPaste()
 };
 
-// Struct to store each row  of text in the editor.
+// Render column of every COL_CHECKPOINT-th char of a long row, so that
+// converting between chars and render columns only walks the chars from the
+// nearest checkpoint. Checkpoints are computed lazily from the left; an edit
+// only drops the ones after it.
+struct colIndex {
+    long *rx; //rx[k] is the render column of char k * COL_CHECKPOINT
+    int n; //checkpoints up to date
+    int cap;
+};
+
+#define COL_CHECKPOINT 512
+#define COL_INDEX_MIN (4 * COL_CHECKPOINT) //shorter rows are just walked
+
+// What a row only needs once it has been drawn. Most rows of a big file are
+// never drawn, so this lives outside the erow, see rowExtraGet().
+struct rowExtra {
+    //the actual charecters to draw on the screen live in the render cache;
+    //the row only remembers which slot it was last rendered into
+    int rslot;
+    unsigned rgen; //generation of rslot at that time, 0 if never rendered
+    unsigned char *hl; //highlight class of each char, NULL until the row is drawn
+    long hlSize; //chars hl has room for
+    struct colIndex *cols; //render columns of a long row, see editorRowCxToRx()
+};
+
+// Struct to store each row  of text in the editor, 32 bytes so that a block
+// of rows stays small even when most lines are short.
 typedef struct erow {
-    int size;
-    int rsize; //length of the render string
-    char *chars;
-    char *render; //contains actual charecters to draw on the screen.
+    long size;
+    struct rowExtra *extra; //NULL until the row is drawn
+    //the text of a ROW_INLINE row, null terminated; otherwise a pointer to
+    //the text, see rowChars()
+    char text[12];
+    //ROW_BORROWED and ROW_INLINE. Worker threads read them through rowChars(),
+    //so they only change on rows no snapshot shares, see editorRowEdit().
+    unsigned char flags;
+    //ROW_RENDER_STALE and ROW_HL_VALID, which the UI thread sets and clears
+    //on rows shared with workers too; a byte of their own keeps them apart
+    unsigned char marks;
+    //lexer state at the start and the end of the row, see editorSyntaxUpdate()
+    unsigned char hlStart, hlEnd;
 }erow;
 
+// Rows shorter than this keep their text inside the erow.
+#define ROW_INLINE_MAX ((long)sizeof(((erow *)0)->text))
+
+// erow.flags: the text points into the mapped file and is not owned by the
+// row. It is not null terminated and must be copied with editorRowOwn() before
+// any edit.
+#define ROW_BORROWED 0x01
+// erow.flags: the text is stored in erow.text itself. Otherwise an owned text
+// is a slab block of size + 1 bytes, see rowResize().
+#define ROW_INLINE 0x02
+// erow.marks: the text changed since the row was last rendered.
+#define ROW_RENDER_STALE 0x01
+// erow.marks: hlStart, hlEnd and hl, if any, match the text.
+#define ROW_HL_VALID 0x02
+
+// Allocator for the text of owned rows and what rows cache. Blocks are cut
+// from chunks of SLAB_CHUNK bytes, one size class per block, with a free list
+// per class and no header per block: the caller passes the size back when it
+// frees. Blocks over SLAB_MAX get a malloc of their own, kept on a list, so a
+// whole slab is freed one chunk at a time and not one row at a time.
+#define SLAB_CHUNK (256 << 10)
+#define SLAB_MAX 4096
+#define SLAB_CLASSES 20 //16 byte steps up to 256, then powers of two
+
+struct textSlab {
+    void *freeList[SLAB_CLASSES]; //linked through the first word of each block
+    char *bump, *bumpEnd; //unused end of the newest chunk
+    char *chunks; //linked through the first word of each chunk
+    struct slabBig *big;
+    size_t held; //bytes of all chunks and big blocks
+    size_t used; //bytes of the blocks handed out
+};
+
+// Header of a block over SLAB_MAX.
+struct slabBig {
+    struct slabBig *prev, *next;
+};
+
+// Highlight classes of the chars of a row.
+enum editorHighlight {
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_MLCOMMENT,
+    HL_KEYWORD1,
+    HL_KEYWORD2,
+    HL_STRING,
+    HL_NUMBER
+};
+
+// States the lexer can end a row in.
+#define HL_STATE_NORMAL 0
+#define HL_STATE_COMMENT 1 //inside a multi-line comment
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
+// How to highlight one kind of file.
+struct editorSyntax {
+    char *filetype;
+    char **filematch; //extensions, or patterns found in the file name
+    char **keywords; //type keywords end in |
+    char *singlelineComment;
+    char *multilineCommentStart;
+    char *multilineCommentEnd;
+    int flags;
+    int prepared; //keywordStart is filled in
+    unsigned char keywordStart[32]; //bitmap of the first chars of keywords
+};
+
+// Maximum number of rows kept in one block of the text store.
+#define ROW_BLOCK_CAP 1024
+
+// A block is a short, contiguous run of rows. Editing only ever moves rows
+// inside a single block, never the whole document.
+// Blocks are shared with snapshots of the document (see storeSnapshot()) and
+// are copied by storeWritable() before a shared one is changed.
+// A block whose rows is still NULL has never been touched: its lines are only
+// described by a slice of the line-offset index of a mapped file, and their
+// erows are created by storeMaterialize() the first time they are needed.
+typedef struct rowBlock {
+    int count; //number of rows in use
+    erow *rows; //room for ROW_BLOCK_CAP rows, or NULL while the block is lazy
+    const char *base; //(lazy) start of the mapped text lineOff is relative to
+    const size_t *lineOff; //(lazy) start offset of each of the count lines
+    size_t end; //(lazy) offset just past the last line, including its newline
+    int refs; //the store plus every snapshot holding the block
+    //soft wrap layout, see wrapLayout(): the visual lines of each row at
+    //wrapCols columns, negated once the row changed, and their sum. A block
+    //never laid out counts one line a row.
+    int *wrap;
+    int wrapCols;
+    int wrapStale; //some rows changed since the block was laid out
+    long vlines;
+    //bytes of the rows as saved, each with its newline, see storeRowOffset()
+    long bytes;
+    int bytesStale;
+    //(lazy) lexer state at the start of the block and after its last line,
+    //once editorSyntaxUpdate() lexed it straight from the mapped text
+    unsigned char hlStart, hlEnd;
+    int hlValid;
+}rowBlock;
+
+// The text store holds all rows of the document as an ordered list of blocks.
+// A Fenwick tree over the block row counts maps a row index to its block, and
+// ones over their visual line counts and byte counts do the same for a visual
+// line and a byte offset.
+struct textStore {
+    rowBlock **blocks;
+    int nblocks;
+    int blockCap; //allocated length of blocks, stale and the trees
+    int *rowTree; //1-based Fenwick tree of rowBlock.count
+    long *wrapTree; //1-based Fenwick tree of rowBlock.vlines
+    long *byteTree; //1-based Fenwick tree of rowBlock.bytes
+    int *stale; //blocks whose byte count is out of date
+    int nstale;
+};
+
+// A frozen copy of the block list. The blocks it holds are never changed
+// again, so another thread can read the document as it was while editing
+// goes on; see storeWritable().
+struct textSnapshot {
+    rowBlock **blocks;
+    int nblocks;
+};
+
+
+// A run of complete lines indexed by the loader thread, waiting to be added to
+// the text store by the UI thread.
+struct loadSlice {
+    const char *base; //text the offsets are relative to
+    size_t *lineOff;
+    size_t nlines;
+    size_t end; //offset just past the last line
+    struct loadSlice *next;
+};
+
+// Line offsets handed to the text store, kept for the line index cache.
+struct lineRun {
+    const size_t *off;
+    size_t n;
+};
+
+// State shared between the UI thread and the thread reading the opened file.
+// Everything below lock is only touched with lock held.
+struct fileLoader {
+    int running; //a loader thread was started and not yet joined (UI thread only)
+    pthread_t tid;
+    int fd; //file being read, for pipes and devices
+    const char *map; //file being indexed, for mapped files
+    size_t size; //size of map, 0 when unknown
+    //(mapped) line offsets an earlier run cached, checked as they are
+    //published, see loaderCached(); NULL if none
+    const size_t *cached;
+    size_t ncached;
+    size_t cacheSize; //bytes of the file the cached offsets cover
+    struct stat st; //(mapped) the file, as the line index cache is keyed by it
+    char *cachePath; //line index cache to write once done, NULL if none
+    char *cacheKey; //absolute path of the file, kept in the cache
+    struct lineRun *runs; //every offset published, in order, for the cache
+    int nruns, runCap;
+    pthread_mutex_t lock;
+    struct loadSlice *head, *tail; //published slices
+    size_t bytesDone;
+    size_t linesDone;
+    int crlf;
+    int done;
+};
+
+// A save running in the background, see editorSave().
+// Everything below lock is only touched with lock held.
+struct saveJob {
+    int running; //a writer thread was started and not yet joined (UI thread only)
+    pthread_t tid;
+    struct textSnapshot snap; //the document as it was when Ctrl-S was pressed
+    int fd; //temporary file written to
+    char *tmp; //its name
+    char *target; //name it is renamed to when complete
+    int dirtyAt; //editC.dirtyFlag when the snapshot was taken
+    long started; //ms
+    pthread_mutex_t lock;
+    off_t total; //bytes to write, 0 until known
+    off_t written;
+    int error; //errno of the failure, 0 if none
+    int done;
+};
+
+#define FIND_MAX_THREADS 8
+
+struct regex;
+struct regexDfa;
+
+// What a search looks for. Plain text is its own literal; a regex keeps the
+// literal every match contains, if any, so rows without it are skipped with
+// searchText() before the DFA reads them.
+struct searchQuery {
+    const char *lit;
+    int litlen;
+    struct regex *re; //NULL for plain text
+    struct regexDfa *dfa; //lazy DFA of re, one per thread searching
+};
+
+// A search running in the background, see editorFindAll(). The counts of
+// the blocks of a chunk are written by one worker and only read by the UI
+// thread once chunkDone says so; everything else below lock is only touched
+// with lock held.
+struct findJob {
+    int running; //workers were started and not yet joined (UI thread only)
+    pthread_t tids[FIND_MAX_THREADS];
+    int nthreads;
+    struct textSnapshot snap; //the document being searched
+    struct searchQuery query; //borrows from editC.find.query; no DFA
+    int first; //block the search starts at, the one under the cursor
+    int nchunks;
+    long *counts; //matches in each block of snap
+    pthread_mutex_t lock;
+    int nextChunk; //next chunk to hand out
+    unsigned char *chunkDone; //1 once a chunk is counted, 2 once the UI has it
+    int cancel;
+};
+
+// A row rewritten by a replace, and its text. Workers fill in the new text;
+// once it is swapped into the document the old text is kept here for undo.
+struct replaceRow {
+    int row; //index in its block while workers run, in the document after
+    char *chars; //a slab block of size + 1 bytes, unless ROW_BORROWED
+    long size;
+    unsigned char flags; //ROW_BORROWED if chars points into the mapped file
+};
+
+// What a replace-all changed, kept by the undo log: the rows it rewrote with
+// the text they do not have right now.
+struct replaceUndo {
+    struct replaceRow *rows;
+    long nrows;
+    long count; //matches replaced
+    size_t bytes; //memory held
+};
+
+// The rows of one block rewritten by a replace worker.
+struct replaceBlock {
+    struct replaceRow *rows;
+    int n, cap;
+    long count; //matches replaced
+};
+
+// A replace-all running on worker threads, see editorReplaceAll(). The UI
+// thread waits for it; lock guards nextChunk and slab.
+struct replaceJob {
+    struct searchQuery query; //borrows from editC.find.query; no DFA
+    const char *with;
+    int wlen;
+    rowBlock **blocks; //of the document
+    struct replaceBlock *out; //one per block
+    int nblocks;
+    pthread_mutex_t lock;
+    int nextChunk;
+    struct textSlab slab; //the new text, from each worker's slab once it is done
+};
+
+// Types of undo records. An edit made of several records, e.g. a row
+// appended then typed into, has U_CONT on all but its first.
+#define U_INSERT 1 //text inserted at row, col; a \n splits the row
+#define U_DELETE 2 //text deleted at row, col; a \n joins the next row
+#define U_NEWROW 3 //an empty row appended at row
+#define U_REPLACE 4 //a replace-all; the text is a pointer to its struct replaceUndo
+#define U_TYPE 0x0f
+#define U_CONT 0x80 //undone and redone with the record before
+#define U_CRLF 0x100 //for undoPush(): newlines in the text may be \r\n or \r
+
+// The undo log, records of edits packed back to back in one buffer that grows
+// geometrically, see undoPush(). Records past pos were undone and can be redone.
+struct undoLog {
+    unsigned char *buf;
+    size_t len, cap;
+    size_t pos; //end of the last record done
+    size_t budget; //bytes kept before the oldest records are dropped
+    size_t extra; //bytes held outside buf by replace records
+    int row; //row of the record ending at pos
+    int applying; //an undo or redo is running, nothing gets recorded
+    int coalesce; //the next typed byte may join the last record
+};
+
+// One character cell of the terminal: the UTF-8 bytes of the character shown
+// there and of the combining marks on it, null padded so that cells compare
+// with memcmp(). The cell right of a double width character is CELL_WIDE_TAIL.
+typedef struct scell {
+    char ch[7];
+    unsigned char attr; //CELL_* bits
+}scell;
+
+#define CELL_WIDE_TAIL '\0' //ch[0] of the second cell of a wide character
+
+static const scell cellBlank = {" ", 0};
+
+// One cached render string. A slot is handed to another row when evicted,
+// which bumps gen so the previous owner's erow.rgen no longer matches.
+struct renderSlot {
+    scell *buf; //one cell per render column
+    int len;
+    int cap;
+    long rxStart; //render column of buf[0], 0 unless only a window is rendered
+    int complete; //buf reaches the end of the row
+    unsigned gen;
+    unsigned frame; //last frame the slot was used in
+    int ref; //used since the clock hand last passed
+};
+
+// Render strings are only kept for the rows drawn recently, in a fixed set of
+// slots reused in CLOCK order, and within a byte budget.
+struct renderCache {
+    struct renderSlot *slots;
+    int nslots;
+    int hand; //next slot to consider for eviction
+    size_t bytes; //bytes of all slot buffers
+    unsigned frame;
+};
+
+
+#define CELL_INVERSE 0x01
+// The upper bits of a cell attribute hold its highlight class.
+#define CELL_HL_SHIFT 4
+
+// A growing buffer that output is collected in and written with one write().
+struct appendBuf {
+    char *buf;
+    int  len;
+    int  cap;
+#ifdef SMEDITOR_DEBUG
+    unsigned allocs; //times the buffer had to grow
+#endif
+};
+
+#ifdef SMEDITOR_DEBUG
+#define BUFFER_INIT  {NULL, 0, 0, 0}
+#else
+#define BUFFER_INIT  {NULL, 0, 0}
+#endif
+
+// What the terminal shows (front) and the frame being drawn (back).
+struct screenState {
+    int rows, cols;
+    scell *front;
+    scell *back;
+    int frontValid; //0 forces a full redraw
+    //offsets the front buffer was drawn with: top is a row, or a visual line
+    //with soft wrap on, when coloffset is -1
+    long top;
+    long coloffset;
+    int syncOutput; //terminal supports synchronized output (mode 2026)
+    struct appendBuf out; //output of the frame, kept between frames
+    size_t frameBytes; //bytes written for the last frame
+    size_t totalBytes;
+#ifdef SMEDITOR_DEBUG
+    unsigned frameAllocs; //times out had to grow for the last frame
+#endif
+    unsigned long frames;
+};
+
+// Bytes read from the terminal but not yet decoded into keys.
+struct inputBuf {
+    unsigned char buf[4096];
+    int start, end;
+};
 
 // A struct to hold edtor configs and state.
 struct editorConfig {
- int cx,cy; //track cursor's position
- int rx; //tracks cursors horizontal render position
+ long cx; //track cursor's position
+ int cy;
+ long rx; //tracks cursors horizontal render position
  //Number of icols and rows in the screen available from ioctl
  int screen_rows;
  int screen_cols;
  int num_rows;
  int rowoffset; //keep track of what row of the file,the user has scrolled to
- int coloffset; //keep track of the contents of a row going horizontally
- erow *row; //Make it an array of rows in order to store rows read from a file.
+ long coloffset; //keep track of the contents of a row going horizontally
+ //soft wrap, toggled with Ctrl-W: rows are folded into lines of screen_cols
+ //columns and the screen scrolls by those, see editorScrollWrap()
+ struct {
+     int on;
+     long seg; //line of row rowoffset at the top of the screen
+     long top; //visual line at the top of the screen, set by editorScroll()
+     long line; //visual line of the cursor
+ } wrap;
+ struct textStore text; //all rows of the document, see editorRowAt()
+ struct textSlab slab; //owned text of the rows, see rowResize()
+ //file opened by editorOpen(), kept mapped for as long as rows borrow from it
+ struct {
+     int fd;
+     char *map;
+     size_t size;
+     int crlf; //some lines end in \r\n
+ } mapped;
+ struct fileLoader loader; //reads the opened file in the background
+ struct saveJob save; //writes the document in the background
+ struct findJob findJob; //counts the matches of a search in the background
+ struct renderCache rcache; //render strings of the rows on screen
+ struct screenState screen; //front and back buffer, see screenFlush()
+ int showStats; //show output bytes per frame in the status bar
+ struct inputBuf input;
+ //state of the event loop, see editorWaitEvent()
+ struct {
+     int wake[2]; //self-pipe written by signal handlers and worker threads
+     volatile sig_atomic_t winch; //the terminal was resized
+     int redraw; //something changed since the last frame
+     long lastFrame; //when the last frame was drawn, in ms
+     int frameMs; //minimum time between two frames
+ } events;
+ struct {
+     char *buf;
+     size_t len, cap;
+ } paste; //text of the last bracketed paste
+ //state of the search in progress, see editorFind()
+ struct {
+     int active;
+     int regex; //the query is a regular expression, toggled with Ctrl-R
+     char *text; //the query as typed
+     int qlen;
+     struct searchQuery query; //text, or the regex compiled from it
+     const char *error; //why the regex does not compile, NULL if it does
+     long *blockMatches; //number of matches in each block of the store
+     int nblocks; //blocks counted in blockMatches
+     long total; //matches counted so far
+     long current; //number of the match under the cursor, 0 if none or not known yet
+     int pending; //jump to the first match once the workers found it
+     long cx, coloffset, wrapseg; //where the search started
+     int cy, rowoffset;
+ } find;
+ struct undoLog undo; //edits that Ctrl-Z undoes, see editorUndo()
+ struct {
+     struct editorSyntax *lang; //NULL if the file is not highlighted
+     int valid; //rows [0, valid) have their lexer state up to date
+ } syntax;
  char *filename; //record the name of the file opened
  char  statusMesg[80];
  time_t status_time;
@@ -69,9 +546,26 @@ struct editorConfig {
 struct editorConfig editC;
 
 /*** prototypes ***/
-void editorSetStatusMessage(const char *fmt, ...);
+void editorSetStatusMsg(const char *fmt, ...);
+void appendToBuffer(struct appendBuf *ab, const char *s, int len);
 void editorRefreshScreen();
-char* editorPrompt(char *prompt);
+char* editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPromptInput(char *prompt, void (*callback)(char *, int), int allowEmpty);
+int editorLoading();
+int editorLoaderPoll();
+int editorSaving();
+int editorSavePoll();
+int editorSavePercent(double *mbps);
+int editorFindPoll();
+void editorWake();
+void editorWaitEvent();
+void editorSyntaxInvalidate(int at);
+unsigned char syntaxLexBlock(rowBlock *blk, unsigned char state, erow *rows);
+void colIndexFree(struct colIndex *ci);
+void undoPush(int type, int row, long col, const char *text, size_t len);
+void lineCacheLoad(struct fileLoader *ld, const char *filename);
+void lineCacheWrite(struct fileLoader *ld);
+void lineCacheTrim(const char *keep);
 
 /** ================= All terminal handling functions. ==========================*/
 
@@ -94,6 +588,8 @@ void handleError(const char *s) {
  *  this function to set the user's terminal back to original state.
  */
 void disableRawMode() {
+    //stop bracketed paste mode again
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO,TCSAFLUSH, &editC.orig_termios) == -1){
         handleError("SMEditor: Failed to diable raw mode.");
     }
@@ -148,6 +644,97 @@ void enableRawMode(){
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         handleError("Error changing terminal config attributes.");
     }
+    //Ask the terminal to wrap pasted text in <esc>[200~ ... <esc>[201~, so a
+    //paste can be inserted in one go instead of as one keypress per byte.
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/**
+ * Reads whatever input is available into the input buffer, without going
+ * through read() once per byte. Returns the number of bytes read, 0 if
+ * nothing arrived within VTIME.
+ */
+int inputFill() {
+    struct inputBuf *in = &editC.input;
+    int nread;
+
+    if (in->start > 0) {
+        memmove(in->buf, &in->buf[in->start], in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+    }
+    if (in->end == (int)sizeof(in->buf)) return 0;
+    nread = read(STDIN_FILENO, &in->buf[in->end], sizeof(in->buf) - in->end);
+    if (nread == -1 && errno != EAGAIN)
+        handleError("SMEDITOR: Error reading charecter.");
+    if (nread <= 0) return 0;
+    in->end += nread;
+    return nread;
+}
+
+/**
+ * Returns 1 if there are bytes read from the terminal that were not decoded
+ * into keys yet.
+ */
+int editorInputPending() {
+    return editC.input.start < editC.input.end;
+}
+
+/**
+ * Returns byte i of the pending input, reading more if it has not arrived
+ * yet, or -1 if it does not arrive within VTIME.
+ */
+int inputPeek(int i) {
+    struct inputBuf *in = &editC.input;
+
+    if (in->start + i >= in->end) inputFill();
+    if (in->start + i >= in->end) return -1;
+    return in->buf[in->start + i];
+}
+
+/**
+ * Collects the text of a bracketed paste, which the terminal sends between
+ * <esc>[200~ and <esc>[201~, into editC.paste.
+ */
+void inputReadPaste() {
+    struct inputBuf *in = &editC.input;
+    const char *endMark = "\x1b[201~";
+    int timeouts = 0;
+
+    editC.paste.len = 0;
+    while (1) {
+        if (in->start == in->end && inputFill() == 0) {
+            //the end marker never came; keep what we have
+            if (++timeouts == 10) return;
+            continue;
+        }
+        //the end marker may itself be split between two reads
+        char *esc = memchr(&in->buf[in->start], '\x1b', in->end - in->start);
+        int chunk = esc ? esc - (char *)&in->buf[in->start] : in->end - in->start;
+        if (editC.paste.len + chunk > editC.paste.cap) {
+            while (editC.paste.len + chunk > editC.paste.cap)
+                editC.paste.cap = editC.paste.cap ? editC.paste.cap * 2 : 4096;
+            editC.paste.buf = realloc(editC.paste.buf, editC.paste.cap);
+        }
+        memcpy(&editC.paste.buf[editC.paste.len], &in->buf[in->start], chunk);
+        editC.paste.len += chunk;
+        in->start += chunk;
+        if (!esc) continue;
+
+        int j;
+        for (j = 0; endMark[j] && inputPeek(j) == endMark[j]; j++);
+        if (!endMark[j]) {
+            in->start += j;
+            return;
+        }
+        //a lone escape inside the pasted text
+        if (editC.paste.len == editC.paste.cap) {
+            editC.paste.cap = editC.paste.cap ? editC.paste.cap * 2 : 4096;
+            editC.paste.buf = realloc(editC.paste.buf, editC.paste.cap);
+        }
+        editC.paste.buf[editC.paste.len++] = '\x1b';
+        in->start++;
+    }
 }
 
 /**
@@ -157,55 +744,74 @@ void enableRawMode(){
  * the four arrow keys was pressed.
  * editorReadKey() to read escape sequences of this form as a single keypress
  * Detect page up and down and multiple codes for HOME and END keys.
+ * Input is read in as large chunks as the terminal delivers and decoded from
+ * the input buffer, one key per call; while there is none, the event loop
+ * runs in editorWaitEvent(). A bracketed paste is returned as a
+ * single PASTE_KEY with its text in editC.paste.
  */
 int editorReadKey() {
-    int nread;
-    char c;
-
-    while((nread = read(STDIN_FILENO, &c, 1)) != 1){
-        if (nread == -1 && errno != EAGAIN)
-            handleError("SMEDITOR: Error reading charecter.");
-    }
-    if (c == '\x1b') {
-        char seq[3];
-
-        if(read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if(read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if (seq[0] == '[') {
-            if(seq[1] >= '0' && seq[1] <= '9') {
-                if(read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if(seq[2] == '~') {
-                    switch(seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            } else {
-                switch(seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
+    struct inputBuf *in = &editC.input;
+
+    editorWaitEvent();
+    //any key may change what is on screen
+    editC.events.redraw = 1;
+
+    int c = in->buf[in->start];
+    if (c != '\x1b') {
+        in->start++;
+        return c;
+    }
+
+    int seq0 = inputPeek(1);
+    if (seq0 == '[') {
+        //<esc>[ followed by numeric parameters and a final byte
+        int i = 2, param = 0, ch;
+        while ((ch = inputPeek(i)) >= '0' && ch <= '9') {
+            param = param * 10 + (ch - '0');
+            i++;
+        }
+        if (ch == -1) {
+            in->start++;
+            return '\x1b';
+        }
+        in->start += i + 1;
+        if (ch == '~') {
+            switch(param) {
+                case 1: return HOME_KEY;
+                case 3: return DEL_KEY;
+                case 4: return END_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 7: return HOME_KEY;
+                case 8: return END_KEY;
+                case 200:
+                    inputReadPaste();
+                    return PASTE_KEY;
             }
-        } else if (seq[0] == '0') {
-            switch(seq[1]) {
+        } else {
+            switch(ch) {
+                case 'A': return ARROW_UP;
+                case 'B': return ARROW_DOWN;
+                case 'C': return ARROW_RIGHT;
+                case 'D': return ARROW_LEFT;
                 case 'H': return HOME_KEY;
                 case 'F': return END_KEY;
             }
         }
         return '\x1b';
-    } else {
-       return c;
+    } else if (seq0 == 'O') {
+        int seq1 = inputPeek(2);
+        if (seq1 != -1) {
+            in->start += 3;
+            switch(seq1) {
+                case 'H': return HOME_KEY;
+                case 'F': return END_KEY;
+            }
+            return '\x1b';
+        }
     }
+    in->start++;
+    return '\x1b';
 }
 
 /**
@@ -263,366 +869,5641 @@ int getWindowSize(int *rows, int *cols) {
         return 0;
     }
 }
-/** ======================== All Editor row manipulation functions  . ===================*/
-
 /**
- * calculate the value of editC.rx properly in editorScroll().
- * editorRowCxToRx() function converts a chars index into a render index.
- * loop through all the characters to the left of cx, and figure out how many
- * spaces each tab takes up.*/
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    for(int k=0; k < cx; k++) {
-        if(row->chars[k] == '\t') {
-            rx += (SMEDITOR_TAB_STOP - 1) - (rx % SMEDITOR_TAB_STOP );
+ * Asks the terminal whether it supports synchronized output (DEC private
+ * mode 2026), which lets us send a frame between <esc>[?2026h and
+ * <esc>[?2026l and have it appear at once, without tearing.
+ * The mode query (DECRQM) is followed by a Primary Device Attributes request
+ * that every terminal answers, so we know when to stop waiting even if the
+ * mode query is ignored.
+ */
+int getSyncOutputSupport() {
+    char buf[128];
+    unsigned int i = 0;
+    int timeouts = 0;
+
+    if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 12) != 12) return 0;
+
+    while (i < sizeof(buf) - 1) {
+        //read() gives up after VTIME (a tenth of a second) without input
+        if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+            if (++timeouts == 5) break;
+            continue;
         }
-        rx++;
+        if (buf[i++] == 'c') break; //end of the device attributes reply
     }
-    return rx;
+    buf[i] = '\0';
+
+    //the reply is <esc>[?2026;Ps$y, where Ps 1 or 2 means set or reset
+    char *reply = strstr(buf, "\x1b[?2026;");
+    if (!reply) return 0;
+    int mode = atoi(reply + 8);
+    return mode == 1 || mode == 2;
 }
+/** ======================== Row text allocation ==================================== */
 
 /**
- * This function uses the chars string of an erow to fill in the contents
- * of the render string
- *
+ * Size class of a block of n bytes, for n up to SLAB_MAX.
  */
-void editorUpdateRow(erow *row) {
-
-    int tabs = 0;
-    int j;
+int slabClass(size_t n) {
+    int c = 16;
+    size_t size = 512;
 
-    //Count charecters  chars in order to allocate memeory for chars
-    for(j=0; j < row->size; j++){
-        if (row->chars[j] == '\t') tabs++;
+    if (n <= 256) return n ? (n - 1) / 16 : 0;
+    while (size < n) {
+        size *= 2;
+        c++;
     }
-    free(row->render);
-    row->render = malloc(row->size + tabs*(SMEDITOR_TAB_STOP - 1) + 1);
-
-    int idx = 0;
+    return c;
+}
 
-    for(j=0;j<row->size;j++){
-        //if tab encountered fill up render with spaces instead
-        if(row->chars[j] == '\t') {
-          row->render[idx++] = ' ';
-          while (idx % SMEDITOR_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
-    }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+size_t slabClassSize(int c) {
+    return c < 16 ? (size_t)(c + 1) * 16 : (size_t)512 << (c - 16);
 }
 
 /**
- * Inserts a row at the specified index
- *
+ * Returns a block of at least n bytes, aligned for any use. A small block is
+ * taken from the free list of its class, or cut from the newest chunk; only
+ * a new chunk every SLAB_CHUNK bytes calls malloc.
  */
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > editC.num_rows) return;
-
-    editC.row = realloc(editC.row, sizeof(erow) * (editC.num_rows + 1));
-    // use memmove() to make room at the specified index for the new row.
-    memmove(&editC.row[at + 1], &editC.row[at],sizeof(erow) * (editC.num_rows - at));
-
-    //int at = editC.num_rows;
-    editC.row[at].size = len;
-    editC.row[at].chars = malloc(len + 1);
-    memcpy(editC.row[at].chars, s, len);
-    editC.row[at].chars[len] = '\0';
+void *slabAlloc(struct textSlab *sl, size_t n) {
+    void *p;
 
-    editC.row[at].rsize = 0;
-    editC.row[at].render = NULL;
-    editorUpdateRow(&editC.row[at]);
-
-    editC.num_rows++;
-    editC.dirtyFlag++;
+    if (n > SLAB_MAX) {
+        struct slabBig *big = malloc(sizeof(struct slabBig) + n);
+        big->prev = NULL;
+        big->next = sl->big;
+        if (sl->big) sl->big->prev = big;
+        sl->big = big;
+        sl->held += sizeof(struct slabBig) + n;
+        sl->used += n;
+        return big + 1;
+    }
+    int c = slabClass(n);
+    size_t size = slabClassSize(c);
+    if (sl->freeList[c]) {
+        p = sl->freeList[c];
+        sl->freeList[c] = *(void **)p;
+    } else {
+        if ((size_t)(sl->bumpEnd - sl->bump) < size) {
+            //the end of the last chunk is left unused, less than SLAB_MAX bytes
+            char *chunk = malloc(SLAB_CHUNK);
+            *(char **)chunk = sl->chunks;
+            sl->chunks = chunk;
+            sl->bump = chunk + 16; //the link, padded to keep blocks aligned
+            sl->bumpEnd = chunk + SLAB_CHUNK;
+            sl->held += SLAB_CHUNK;
+        }
+        p = sl->bump;
+        sl->bump += size;
+    }
+    sl->used += size;
+    return p;
 }
 
 /**
- * Frees memory held for row and char array
- *
+ * Gives back a block of n bytes, n being the size it was allocated or last
+ * resized with.
  */
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
+void slabFree(struct textSlab *sl, void *p, size_t n) {
+    if (!p) return;
+    if (n > SLAB_MAX) {
+        struct slabBig *big = (struct slabBig *)p - 1;
+        if (big->prev) big->prev->next = big->next;
+        else sl->big = big->next;
+        if (big->next) big->next->prev = big->prev;
+        sl->held -= sizeof(struct slabBig) + n;
+        sl->used -= n;
+        free(big);
+        return;
+    }
+    int c = slabClass(n);
+    *(void **)p = sl->freeList[c];
+    sl->freeList[c] = p;
+    sl->used -= slabClassSize(c);
 }
+
 /**
- * free the memory owned by the row using editorFreeRow(). Then use memmove()
- * to overwrite the deleted row struct with the rest of the rows that come after it,
- * and decrement numrows. Finally, we increment E.dirty.
+ * Resizes a block of old bytes to n bytes, keeping its contents as far as
+ * they fit. The block only moves when its size class changes.
  */
-void editorDelRow(int at) {
-    if(at < 0 || at >= editC.num_rows) return;
-    editorFreeRow(&editC.row[at]);
-    memmove(&editC.row[at], &editC.row[at + 1],sizeof(erow) * (editC.num_rows - at - 1));
-    editC.num_rows--;
-    editC.dirtyFlag++;
+void *slabRealloc(struct textSlab *sl, void *p, size_t old, size_t n) {
+    if (!p) return slabAlloc(sl, n);
+    if (old > SLAB_MAX && n > SLAB_MAX) {
+        struct slabBig *big = realloc((struct slabBig *)p - 1, sizeof(struct slabBig) + n);
+        if (big->prev) big->prev->next = big;
+        else sl->big = big;
+        if (big->next) big->next->prev = big;
+        sl->held += n - old;
+        sl->used += n - old;
+        return big + 1;
+    }
+    if (old <= SLAB_MAX && n <= SLAB_MAX && slabClass(old) == slabClass(n)) return p;
+    void *moved = slabAlloc(sl, n);
+    memcpy(moved, p, old < n ? old : n);
+    slabFree(sl, p, old);
+    return moved;
 }
+
 /**
- * Allows the user to edit the opened file, one char at a time.
+ * Frees every block of a slab at once, in O(chunks).
  */
-void editorInsertCharAt(erow *row, int at, int c) {
-    //validate at, which is the index we want to insert the character into
-    //at allowed to go past the end of the string in order to insert at the end
-    //of the row
-    if (at < 0 || at > row->size) at = row->size;
-    // allocate one more byte for the chars of the erow
-    // (we add 2 because we also have to make room for the null byte),
-    // and use memmove() to make room for the new character.
-    row->chars = realloc(row->chars, row->size + 2); // Add 2 to make room for null byte.
-    //use memmove to make room for the new char.
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    editC.dirtyFlag++;
+void slabFreeAll(struct textSlab *sl) {
+    while (sl->chunks) {
+        char *next = *(char **)sl->chunks;
+        free(sl->chunks);
+        sl->chunks = next;
+    }
+    while (sl->big) {
+        struct slabBig *next = sl->big->next;
+        free(sl->big);
+        sl->big = next;
+    }
+    memset(sl, 0, sizeof(*sl));
 }
+
 /**
- * appends a string to the end of a row.
+ * Moves the chunks and blocks of src into dst, e.g. once a worker thread
+ * that filled src is done. What is left of the newest chunk of src is lost.
  */
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    //rows new size is row->size _ leb + 1 including null byte.
-    row->chars = realloc(row->chars,row->size + len + 1);
-    //memcpy the given string to the end of the contents of row->chars
-    memcpy(&row->chars[row->size],s,len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    editC.dirtyFlag++;
+void slabMerge(struct textSlab *dst, struct textSlab *src) {
+    int c;
+
+    if (src->chunks) {
+        char *last = src->chunks;
+        while (*(char **)last) last = *(char **)last;
+        *(char **)last = dst->chunks;
+        dst->chunks = src->chunks;
+    }
+    if (src->big) {
+        struct slabBig *last = src->big;
+        while (last->next) last = last->next;
+        last->next = dst->big;
+        if (dst->big) dst->big->prev = last;
+        dst->big = src->big;
+    }
+    for (c = 0; c < SLAB_CLASSES; c++) {
+        void **last = &src->freeList[c];
+        while (*last) last = (void **)*last;
+        *last = dst->freeList[c];
+        dst->freeList[c] = src->freeList[c];
+    }
+    dst->held += src->held;
+    dst->used += src->used;
+    memset(src, 0, sizeof(*src));
 }
 
 /**
- * Deletes a char from a row.
+ * Returns the text of a row, which is not null terminated if the row is
+ * ROW_BORROWED.
  */
-void editorRowDelChar(erow *row, int at) {
-    if(at <0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at+1],row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    editC.dirtyFlag++;
+static inline char *rowChars(const erow *row) {
+    char *chars;
+
+    if (row->flags & ROW_INLINE) return (char *)row->text;
+    memcpy(&chars, row->text, sizeof(chars));
+    return chars;
 }
-/** i==================================== editor operations. ===================
- *  contains functions that we?ll call from editorProcessKeypress() when we?re
- *  mapping keypresses to various text editing operations
- */
-void editorInsertChar(int c) {
-    //If editC.cy == editC.numrows, then the cursor is on the tilde line after
-    //the end of the file, so we need to append a new row
-    if (editC.cy == editC.num_rows) {
-        editorInsertRow(editC.num_rows,"",0);
-    }
-    editorInsertCharAt(&editC.row[editC.cy], editC.cx, c);
-    editC.cx++;
+
+static inline void rowSetChars(erow *row, const char *chars) {
+    memcpy(row->text, &chars, sizeof(chars));
 }
 
 /**
- *
+ * Gives a row that owns no text yet a copy of the len chars at s.
  */
-void editorInsertNewline() {
-    if(editC.cx ==0) {
-        editorInsertRow(editC.cy,"",0);
-    } else {
-        //split the line we?re on into two rows
-        erow *row = &editC.row[editC.cy];
-        //First we call editorInsertRow() and pass it the characters
-        //on the current row that are to the right of the cursor.
-        //That creates a new row after the current one, with the correct contents.
-        editorInsertRow(editC.cy + 1, &row->chars[editC.cx], row->size - editC.cx);
-        //Then we reassign the row pointer, because editorInsertRow() calls realloc(),
-        //which might move memory around on us and invalidate the pointer
-        row = &editC.row[editC.cy];
-        row->size = editC.cx;
-        //we truncate the current row's contents by setting its size to the position
-        //of the cursor, and we call editorUpdateRow() on the truncated row.
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+void rowSetText(erow *row, const char *s, long len) {
+    row->size = len;
+    row->flags &= ~(ROW_BORROWED | ROW_INLINE);
+    if (len < ROW_INLINE_MAX) {
+        row->flags |= ROW_INLINE;
+        memcpy(row->text, s, len);
+        row->text[len] = '\0';
+        return;
     }
-    editC.cy++;
-    editC.cx = 0;
+    char *chars = slabAlloc(&editC.slab, len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    rowSetChars(row, chars);
 }
 
-void editorDelChar() {
-    //If editC.cy == editC.numrows, then the cursor is on the tilde line after
-    //the end of the file, so we need to append a new row
-    if (editC.cy == editC.num_rows) return;
-    //if the cursor is at the beginning of the first line, do nothing
-    if (editC.cx == 0 && editC.cy == 0) return;
+/**
+ * Changes the length of the owned text of a row to size, keeping the chars
+ * that fit, and null terminates it. Moves the text into or out of the erow
+ * or to another size class as needed; returns where it is now.
+ */
+char *rowResize(erow *row, long size) {
+    char *chars = rowChars(row);
+    long keep = row->size < size ? row->size : size;
 
-    erow *row = &editC.row[editC.cy];
-    if(editC.cx > 0) {
-        editorRowDelChar(row, editC.cx -1);
-        editC.cx--;
+    if (size < ROW_INLINE_MAX) {
+        if (!(row->flags & ROW_INLINE)) {
+            char tmp[ROW_INLINE_MAX];
+            memcpy(tmp, chars, keep);
+            slabFree(&editC.slab, chars, row->size + 1);
+            memcpy(row->text, tmp, keep);
+            row->flags |= ROW_INLINE;
+        }
+        chars = row->text;
+    } else if (row->flags & ROW_INLINE) {
+        chars = slabAlloc(&editC.slab, size + 1);
+        memcpy(chars, row->text, keep);
+        row->flags &= ~ROW_INLINE;
+        rowSetChars(row, chars);
     } else {
-        editC.cx = editC.row[editC.cy - 1].size;
-        editorRowAppendString(&editC.row[editC.cy -1], row->chars,row->size);
-        editorDelRow(editC.cy);
-        editC.cy--;
+        chars = slabRealloc(&editC.slab, chars, row->size + 1, size + 1);
+        rowSetChars(row, chars);
     }
+    row->size = size;
+    chars[size] = '\0';
+    return chars;
 }
-/** ======================== File IO functions ===================================== */
 
 /**
- *  converts our array of erow structs into a single string that is ready
- *  to be written out to a file.
+ * Returns what a row keeps once drawn, allocating it the first time.
  */
-char * editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    //First we add up the lengths of each row of text, adding 1 to each one
-    //for the newline character we?ll add to the end of each line.
-    for(j=0;j<editC.num_rows;j++) {
-        totlen += editC.row[j].size + 1;
+struct rowExtra *rowExtraGet(erow *row) {
+    if (!row->extra) {
+        row->extra = slabAlloc(&editC.slab, sizeof(struct rowExtra));
+        memset(row->extra, 0, sizeof(struct rowExtra));
     }
-    //Save the total length into buflen, to tell the caller how long the string is
-    *buflen = totlen;
+    return row->extra;
+}
 
-    char *buf = malloc(totlen);
-    char *p = buf;
+/**
+ * Frees the text a row owns and what it keeps once drawn.
+ */
+void rowFree(erow *row) {
+    struct rowExtra *ex = row->extra;
 
-    for(j=0; j<editC.num_rows;j++) {
-        memcpy(p, editC.row[j].chars,editC.row[j].size);
-        p += editC.row[j].size;
-        *p = '\n';
-        p++;
+    if (!(row->flags & (ROW_BORROWED | ROW_INLINE)))
+        slabFree(&editC.slab, rowChars(row), row->size + 1);
+    if (ex) {
+        slabFree(&editC.slab, ex->hl, ex->hlSize);
+        colIndexFree(ex->cols);
+        slabFree(&editC.slab, ex, sizeof(struct rowExtra));
     }
-    //return buf, expecting the caller to free() the memory
-    return buf;
-}
-void editorOpen(char *filename) {
-    free(editC.filename);
-    //Allocate memory and make a copy of the given filename using string function strdup
-    editC.filename = strdup(filename);
-    FILE *fp = fopen(filename,"r");
-    if(!fp) handleError("[SMEditor]: Could not open file.");
-
-    char *line = NULL;
-    ssize_t lineCap = 0;
-    ssize_t lineLen;
-
-    while((lineLen = getline(&line,&lineCap,fp)) != -1) {
-        //strip off the newline or carriage return at the end of the line
-        //before copying it into our erow
-        while(lineLen >0 && (line[lineLen - 1] == '\n' ||
-                             line[lineLen - 1] == '\r'))
-            lineLen--;
-        editorInsertRow(editC.num_rows,line, lineLen);
-    }
-    free(line);
-    fclose(fp);
-    editC.dirtyFlag = 0;
 }
+
+/** ======================== Text store functions. ==================================*/
+
 /**
- * Note: The normal way to overwrite a file is to pass the O_TRUNC flag to open(),
- * which truncates the file completely, making it an empty file, before writing the
- * new data into it.
- * By truncating the file ourselves to the same length as the data we are planning to write
- * into it, we are making the whole overwriting operation a little bit safer in case the
- * ftruncate() call succeeds but the write() call fails. In that case, the file would
- * still contain most of the data it had before. But if the file was truncated completely
- * by the open() call and then the write() failed, you'd  end up with all of your data lost
- *
- * More advanced editors will write to a new, temporary file, and then rename that file
- * to the actual file the user wants to overwrite, and they?ll carefully check for errors
- * through the whole process.
- *
+ * Rebuilds the Fenwick trees over the block row counts and visual line counts
+ * in O(nblocks). Only needed when blocks are added or removed, which happens
+ * once every ROW_BLOCK_CAP/2 row insertions at most.
  */
-void editorSave() {
-    if (editC.filename == NULL) {
-        editC.filename = editorPrompt("Save file as: %s");
-        if (editC.filename == NULL) {
-            editorSetStatusMsg("Save aborted.");
-            return;
-        }
+void storeReindex(struct textStore *ts) {
+    int i;
+    ts->nstale = 0;
+    for (i = 1; i <= ts->nblocks; i++) {
+        ts->rowTree[i] = ts->blocks[i - 1]->count;
+        ts->wrapTree[i] = ts->blocks[i - 1]->vlines;
+        ts->byteTree[i] = ts->blocks[i - 1]->bytes;
+        if (ts->blocks[i - 1]->bytesStale) ts->stale[ts->nstale++] = i - 1;
     }
-
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(editC.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1) {
-        if(ftruncate(fd,len) != -1) {//sets the file size to the specified length.
-            write(fd,buf,len);
-            close(fd);
-            free(buf);
-            editC.dirtyFlag = 0;
-            editorSetStatusMsg("%d bytes written to disk.", len);
-            return;
+    for (i = 1; i <= ts->nblocks; i++) {
+        int parent = i + (i & -i);
+        if (parent <= ts->nblocks) {
+            ts->rowTree[parent] += ts->rowTree[i];
+            ts->wrapTree[parent] += ts->wrapTree[i];
+            ts->byteTree[parent] += ts->byteTree[i];
         }
-        close(fd);
     }
-    free(buf);
-    editorSetStatusMsg("Failed to save file to disk: %s", strerror(errno));
 }
 
-/** ======================== Find Functions============================*/
-void editorFind() {
-    char *query = editorPrompt("Search: %s (Press Esc to cancel)");
-    if (query == NULL) return;
+/**
+ * Adds delta to the row count of block b and to every Fenwick node covering it.
+ */
+void storeAdjust(struct textStore *ts, int b, int delta) {
+    ts->blocks[b]->count += delta;
+    for (b++; b <= ts->nblocks; b += b & -b) ts->rowTree[b] += delta;
+}
+
+/**
+ * Adds delta to the visual line count of block b, see storeAdjust().
+ */
+void storeAdjustWrap(struct textStore *ts, int b, long delta) {
+    ts->blocks[b]->vlines += delta;
+    for (b++; b <= ts->nblocks; b += b & -b) ts->wrapTree[b] += delta;
+}
+
+/**
+ * Adds delta to the byte count of block b, see storeAdjust().
+ */
+void storeAdjustBytes(struct textStore *ts, int b, long delta) {
+    ts->blocks[b]->bytes += delta;
+    for (b++; b <= ts->nblocks; b += b & -b) ts->byteTree[b] += delta;
+}
+
+/**
+ * Notes that the rows of block b changed length. Its byte count is worked out
+ * again when an offset past it is asked for, see storeBytesFresh(), so an
+ * edit costs nothing here however many it makes.
+ */
+void storeMarkBytes(struct textStore *ts, int b) {
+    if (ts->blocks[b]->bytesStale) return;
+    ts->blocks[b]->bytesStale = 1;
+    ts->stale[ts->nstale++] = b;
+}
+
+/**
+ * Finds the block holding row at, and the index of the row inside that block,
+ * by walking down the Fenwick tree in O(log nblocks).
+ * Returns nblocks when at is past the last row.
+ */
+int storeLocate(struct textStore *ts, int at, int *idx) {
+    int pos = 0, step = 1;
+
+    while (step * 2 <= ts->nblocks) step *= 2;
+    for (; step; step /= 2) {
+        if (pos + step <= ts->nblocks && ts->rowTree[pos + step] <= at) {
+            pos += step;
+            at -= ts->rowTree[pos];
+        }
+    }
+    *idx = at;
+    return pos;
+}
+
+/**
+ * Index of the first row of block b: the sum of the row counts before it,
+ * read from the Fenwick tree.
+ */
+int storeBlockStart(struct textStore *ts, int b) {
+    int start = 0;
+
+    for (; b > 0; b -= b & -b) start += ts->rowTree[b];
+    return start;
+}
+
+/**
+ * Allocates an empty block and puts it at position b of the block list.
+ * Its rows are allocated by storeMaterialize() when the block is first used.
+ */
+rowBlock *storeAddBlock(struct textStore *ts, int b) {
+    if (ts->nblocks == ts->blockCap) {
+        ts->blockCap = ts->blockCap ? ts->blockCap * 2 : 16;
+        ts->blocks = realloc(ts->blocks, sizeof(rowBlock *) * ts->blockCap);
+        ts->rowTree = realloc(ts->rowTree, sizeof(int) * (ts->blockCap + 1));
+        ts->wrapTree = realloc(ts->wrapTree, sizeof(long) * (ts->blockCap + 1));
+        ts->byteTree = realloc(ts->byteTree, sizeof(long) * (ts->blockCap + 1));
+        ts->stale = realloc(ts->stale, sizeof(int) * ts->blockCap);
+    }
+    rowBlock *blk = malloc(sizeof(rowBlock));
+    blk->count = 0;
+    blk->rows = NULL;
+    blk->base = NULL;
+    blk->lineOff = NULL;
+    blk->end = 0;
+    blk->refs = 1;
+    blk->wrap = NULL;
+    blk->wrapCols = 0;
+    blk->wrapStale = 0;
+    blk->vlines = 0;
+    blk->bytes = 0;
+    blk->bytesStale = 0;
+    blk->hlStart = blk->hlEnd = 0;
+    blk->hlValid = 0;
+
+    memmove(&ts->blocks[b + 1], &ts->blocks[b], sizeof(rowBlock *) * (ts->nblocks - b));
+    ts->blocks[b] = blk;
+    ts->nblocks++;
+    return blk;
+}
+
+/**
+ * Drops one reference to a block, and frees it with the text its rows own
+ * once nothing refers to it any more.
+ */
+void blockRelease(rowBlock *blk) {
+    int j;
+
+    if (--blk->refs > 0) return;
+    if (blk->rows) {
+        for (j = 0; j < blk->count; j++) rowFree(&blk->rows[j]);
+        free(blk->rows);
+    }
+    free(blk->wrap);
+    free(blk);
+}
+
+/**
+ * Takes a snapshot of the document. This only copies the block list; the
+ * blocks are shared until the editor changes one of them.
+ */
+void storeSnapshot(struct textStore *ts, struct textSnapshot *snap) {
+    int b;
+
+    snap->nblocks = ts->nblocks;
+    snap->blocks = malloc(sizeof(rowBlock *) * (ts->nblocks ? ts->nblocks : 1));
+    for (b = 0; b < ts->nblocks; b++) {
+        snap->blocks[b] = ts->blocks[b];
+        snap->blocks[b]->refs++;
+    }
+}
+
+void snapshotRelease(struct textSnapshot *snap) {
+    int b;
+
+    for (b = 0; b < snap->nblocks; b++) blockRelease(snap->blocks[b]);
+    free(snap->blocks);
+    snap->blocks = NULL;
+    snap->nblocks = 0;
+}
+
+/**
+ * Frees every block of a store that no snapshot holds any more, in
+ * O(blocks). The rows are not visited: what they own is freed with the slab
+ * it came from, see slabFreeAll().
+ */
+void storeFree(struct textStore *ts) {
+    int b;
+
+    for (b = 0; b < ts->nblocks; b++) {
+        free(ts->blocks[b]->rows);
+        free(ts->blocks[b]->wrap);
+        free(ts->blocks[b]);
+    }
+    free(ts->blocks);
+    free(ts->rowTree);
+    free(ts->wrapTree);
+    free(ts->byteTree);
+    free(ts->stale);
+    memset(ts, 0, sizeof(*ts));
+}
+
+/**
+ * Removes block b from the block list and frees it. The rows it held must
+ * already have been freed or moved.
+ */
+void storeDropBlock(struct textStore *ts, int b) {
+    blockRelease(ts->blocks[b]);
+    memmove(&ts->blocks[b], &ts->blocks[b + 1], sizeof(rowBlock *) * (ts->nblocks - b - 1));
+    ts->nblocks--;
+    storeReindex(ts);
+}
+
+/**
+ * Returns the text of line j of a block and its length without the line
+ * terminator. Works for lazy blocks without materializing them.
+ */
+const char *blockLine(rowBlock *blk, int j, long *len) {
+    if (blk->rows) {
+        *len = blk->rows[j].size;
+        return rowChars(&blk->rows[j]);
+    }
+    size_t start = blk->lineOff[j];
+    size_t end = (j + 1 < blk->count) ? blk->lineOff[j + 1] : blk->end;
+    //strip off the newline or carriage return at the end of the line
+    while (end > start && (blk->base[end - 1] == '\n' || blk->base[end - 1] == '\r'))
+        end--;
+    *len = end - start;
+    return blk->base + start;
+}
+
+/**
+ * Turns a lazy block into real rows. The rows borrow their text from the
+ * mapping, so this costs one erow per line and no copy of the text itself.
+ * Nothing is rendered until the row is drawn. A block the highlighter went
+ * past while lazy has its rows lexed again from its start state, as the
+ * rows after it are not looked at again.
+ */
+void storeMaterialize(rowBlock *blk) {
+    int j;
+
+    if (blk->rows) return;
+    erow *rows = malloc(sizeof(erow) * ROW_BLOCK_CAP);
+    for (j = 0; j < blk->count; j++) {
+        long len;
+        rowSetChars(&rows[j], blockLine(blk, j, &len));
+        rows[j].size = len;
+        rows[j].flags = ROW_BORROWED;
+        rows[j].marks = 0;
+        rows[j].extra = NULL;
+    }
+    if (blk->hlValid) syntaxLexBlock(blk, blk->hlStart, rows);
+    blk->rows = rows;
+}
+
+/**
+ * Makes block b safe to change. While a snapshot still refers to the block,
+ * the store gets a private copy of it and the snapshot keeps the original.
+ * Text owned by the rows is copied as well, since edits change it in place;
+ * text borrowed from the opened file never changes and is shared.
+ */
+rowBlock *storeWritable(struct textStore *ts, int b) {
+    rowBlock *blk = ts->blocks[b];
+    int j;
+
+    if (blk->refs == 1) return blk;
+    rowBlock *copy = malloc(sizeof(rowBlock));
+    *copy = *blk;
+    copy->refs = 1;
+    if (blk->wrap) {
+        copy->wrap = malloc(sizeof(int) * ROW_BLOCK_CAP);
+        memcpy(copy->wrap, blk->wrap, sizeof(int) * blk->count);
+    }
+    if (blk->rows) {
+        copy->rows = malloc(sizeof(erow) * ROW_BLOCK_CAP);
+        memcpy(copy->rows, blk->rows, sizeof(erow) * blk->count);
+        for (j = 0; j < copy->count; j++) {
+            erow *row = &copy->rows[j];
+            //the highlight stays with the original; the copy makes its own when drawn
+            row->extra = NULL;
+            if (row->flags & (ROW_BORROWED | ROW_INLINE)) continue;
+            char *chars = slabAlloc(&editC.slab, row->size + 1);
+            memcpy(chars, rowChars(row), row->size + 1);
+            rowSetChars(row, chars);
+        }
+    }
+    blk->refs--;
+    ts->blocks[b] = copy;
+    return copy;
+}
+
+/**
+ * Returns the row at index at for reading and drawing. The pointer stays
+ * valid until the next row is inserted into or deleted from the store.
+ * The row may be shared with a snapshot; use editorRowEdit() to change it.
+ */
+erow *editorRowAt(int at) {
+    int idx;
+    int b = storeLocate(&editC.text, at, &idx);
+    rowBlock *blk = editC.text.blocks[b];
+
+    //materializing changes the block, so a shared lazy block is copied first
+    if (!blk->rows) blk = storeWritable(&editC.text, b);
+    storeMaterialize(blk);
+    return &blk->rows[idx];
+}
+
+/**
+ * Returns the row at index at, ready to be changed.
+ */
+erow *editorRowEdit(int at) {
+    int idx;
+    int b = storeLocate(&editC.text, at, &idx);
+    rowBlock *blk = storeWritable(&editC.text, b);
+
+    editorSyntaxInvalidate(at);
+    storeMarkBytes(&editC.text, b);
+    //the row is laid out again when soft wrap next needs it
+    if (blk->wrap && blk->wrap[idx] > 0) {
+        blk->wrap[idx] = -blk->wrap[idx];
+        blk->wrapStale = 1;
+    }
+
+    storeMaterialize(blk);
+    return &blk->rows[idx];
+}
+
+/**
+ * Returns the visual lines of the rows of a laid out block, stale ones
+ * included with the count they had.
+ */
+long blockWrapLines(rowBlock *blk) {
+    long sum = 0;
+    int j;
+
+    for (j = 0; j < blk->count; j++) sum += labs(blk->wrap[j]);
+    return sum;
+}
+
+/**
+ * Opens a hole for a new row at index at and returns it. Only the rows after
+ * at inside the same block are moved; a full block is first split in two.
+ */
+erow *storeInsertRow(struct textStore *ts, int at) {
+    int idx, b;
+
+    if (ts->nblocks == 0) {
+        storeAddBlock(ts, 0);
+        storeReindex(ts);
+    }
+    b = storeLocate(ts, at, &idx);
+    if (b == ts->nblocks) {
+        //appending past the last row goes to the end of the last block
+        b = ts->nblocks - 1;
+        idx = ts->blocks[b]->count;
+    }
+
+    rowBlock *blk = storeWritable(ts, b);
+    storeMaterialize(blk);
+    if (blk->count == ROW_BLOCK_CAP) {
+        int half = ROW_BLOCK_CAP / 2;
+        rowBlock *next = storeAddBlock(ts, b + 1);
+        storeMaterialize(next);
+        memcpy(next->rows, &blk->rows[half], sizeof(erow) * (ROW_BLOCK_CAP - half));
+        next->count = ROW_BLOCK_CAP - half;
+        blk->count = half;
+        if (blk->wrap) {
+            next->wrap = malloc(sizeof(int) * ROW_BLOCK_CAP);
+            memcpy(next->wrap, &blk->wrap[half], sizeof(int) * next->count);
+            next->wrapCols = blk->wrapCols;
+            next->wrapStale = blk->wrapStale;
+            next->vlines = blockWrapLines(next);
+            blk->vlines -= next->vlines;
+        } else {
+            next->vlines = next->count;
+            blk->vlines = half;
+        }
+        blk->bytesStale = next->bytesStale = 1;
+        storeReindex(ts);
+        if (idx > half) {
+            b++;
+            idx -= half;
+            blk = next;
+        }
+    }
+    memmove(&blk->rows[idx + 1], &blk->rows[idx], sizeof(erow) * (blk->count - idx));
+    if (blk->wrap) {
+        //counted as one line until it is laid out
+        memmove(&blk->wrap[idx + 1], &blk->wrap[idx], sizeof(int) * (blk->count - idx));
+        blk->wrap[idx] = -1;
+        blk->wrapStale = 1;
+    }
+    storeAdjust(ts, b, 1);
+    storeAdjustWrap(ts, b, 1);
+    storeMarkBytes(ts, b);
+    return &blk->rows[idx];
+}
+
+/**
+ * Takes the row at index at out of the store. The caller frees its contents.
+ */
+void storeRemoveRow(struct textStore *ts, int at) {
+    int idx;
+    int b = storeLocate(ts, at, &idx);
+    rowBlock *blk = storeWritable(ts, b);
+
+    storeMaterialize(blk);
+    memmove(&blk->rows[idx], &blk->rows[idx + 1], sizeof(erow) * (blk->count - idx - 1));
+    if (blk->wrap) {
+        storeAdjustWrap(ts, b, -labs(blk->wrap[idx]));
+        memmove(&blk->wrap[idx], &blk->wrap[idx + 1], sizeof(int) * (blk->count - idx - 1));
+    } else {
+        storeAdjustWrap(ts, b, -1);
+    }
+    storeAdjust(ts, b, -1);
+    storeMarkBytes(ts, b);
+    if (blk->count == 0) storeDropBlock(ts, b);
+}
+
+/**
+ * Returns the bytes the rows of a block take once saved, each with its
+ * newline. A lazy block of a file without \r\n is the slice of the file it
+ * describes, plus the newline the last line of the file may lack.
+ */
+long blockBytes(rowBlock *blk) {
+    long sum = 0, len;
+    int j;
+
+    if (!blk->rows && !editC.mapped.crlf) {
+        //only the last line of the file can lack one, so the mapping is only
+        //read for the block holding it
+        int last = blk->base != editC.mapped.map || blk->end == editC.mapped.size;
+        return blk->end - blk->lineOff[0] + (last && blk->base[blk->end - 1] != '\n');
+    }
+    for (j = 0; j < blk->count; j++) {
+        blockLine(blk, j, &len);
+        sum += len + 1;
+    }
+    return sum;
+}
+
+/**
+ * Works out again the byte count of the stale blocks before block upto, so
+ * the byte tree can be read up to there.
+ */
+void storeBytesFresh(struct textStore *ts, int upto) {
+    int k = 0;
+
+    while (k < ts->nstale) {
+        int b = ts->stale[k];
+        if (b >= upto) {
+            k++;
+            continue;
+        }
+        ts->blocks[b]->bytesStale = 0;
+        storeAdjustBytes(ts, b, blockBytes(ts->blocks[b]) - ts->blocks[b]->bytes);
+        ts->stale[k] = ts->stale[--ts->nstale];
+    }
+}
+
+/**
+ * Returns the byte offset row at starts at in the document as saved: the
+ * bytes of the blocks before its own from the Fenwick tree, plus those of the
+ * rows before it in its block. Row num_rows starts at the end of the text.
+ */
+long storeRowOffset(struct textStore *ts, int at) {
+    int idx, j, n, b = storeLocate(ts, at, &idx);
+    long off = 0, len;
+
+    storeBytesFresh(ts, b);
+    for (n = b; n > 0; n -= n & -n) off += ts->byteTree[n];
+    if (b == ts->nblocks) return off;
+    rowBlock *blk = ts->blocks[b];
+    if (!blk->rows && !editC.mapped.crlf) return off + blk->lineOff[idx] - blk->lineOff[0];
+    for (j = 0; j < idx; j++) {
+        blockLine(blk, j, &len);
+        off += len + 1;
+    }
+    return off;
+}
+
+/**
+ * Finds the row byte offset off falls in by walking down the byte tree, and
+ * stores where in the row it is in col; the newline of a row is at col size.
+ * An offset past the end of the text is the end of the last row.
+ */
+int storeOffsetRow(struct textStore *ts, long off, long *col) {
+    int pos = 0, step = 1, start, lo, hi;
+    long len;
+
+    storeBytesFresh(ts, ts->nblocks);
+    while (step * 2 <= ts->nblocks) step *= 2;
+    for (; step; step /= 2) {
+        if (pos + step <= ts->nblocks && ts->byteTree[pos + step] <= off) {
+            pos += step;
+            off -= ts->byteTree[pos];
+        }
+    }
+    if (pos == ts->nblocks) {
+        *col = 0;
+        if (pos == 0) return 0;
+        rowBlock *last = ts->blocks[pos - 1];
+        blockLine(last, last->count - 1, col);
+        return storeBlockStart(ts, pos) - 1;
+    }
+    rowBlock *blk = ts->blocks[pos];
+    start = storeBlockStart(ts, pos);
+    if (!blk->rows && !editC.mapped.crlf) {
+        //the last line starting at or before the offset
+        lo = 0;
+        hi = blk->count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if ((long)(blk->lineOff[mid] - blk->lineOff[0]) <= off) lo = mid;
+            else hi = mid - 1;
+        }
+        *col = off - (blk->lineOff[lo] - blk->lineOff[0]);
+        return start + lo;
+    }
+    for (lo = 0;; lo++) {
+        blockLine(blk, lo, &len);
+        if (off <= len) break;
+        off -= len + 1;
+    }
+    *col = off;
+    return start + lo;
+}
+
+/** ======================== Syntax highlighting ================================== */
+/*
+ * Rows are highlighted by a small lexer that runs over one row at a time,
+ * starting in the state the row before ended in. Each row keeps the state it
+ * was lexed from and the state it ended in, so an edit only makes the rows
+ * from the changed one on candidates for lexing again, and a row is lexed
+ * again only if it changed or starts in another state than before.
+ */
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "do", "goto", "sizeof", "const", "volatile", "extern", "inline",
+    "#include", "#define", "#ifdef", "#ifndef", "#endif", "#else", "#if",
+
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", NULL
+};
+
+// The highlight database, one entry per kind of file.
+struct editorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        C_HL_keywords,
+        "//", "/*", "*/",
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        0, {0}
+    },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+int isSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// isSeparator() of every byte, filled in by syntaxLex() on first use.
+unsigned char syntaxSeparators[256];
+
+static inline void syntaxMark(unsigned char *hl, long from, long n, unsigned char cls) {
+    if (hl) memset(&hl[from], cls, n);
+}
+
+/**
+ * Lexes the size chars of a row that starts in state, and returns the state
+ * it ends in. The class of each char goes to hl, unless hl is NULL because
+ * the row is only passed on the way to the screen.
+ */
+unsigned char syntaxLex(struct editorSyntax *lang, const char *s, long size,
+                        unsigned char state, unsigned char *hl) {
+    char **keywords = lang->keywords;
+    char *scs = lang->singlelineComment;
+    char *mcs = lang->multilineCommentStart;
+    char *mce = lang->multilineCommentEnd;
+    int scsLen = scs ? strlen(scs) : 0;
+    int mcsLen = mcs ? strlen(mcs) : 0;
+    int mceLen = mce ? strlen(mce) : 0;
+    int prevSep = 1, inString = 0, inComment = state == HL_STATE_COMMENT;
+    unsigned char prevHl = HL_NORMAL;
+    unsigned char *sep = syntaxSeparators;
+    long i = 0;
+    int j;
+
+    if (!sep['\0']) {
+        for (j = 0; j < 256; j++) sep[j] = isSeparator(j);
+    }
+    if (!lang->prepared) {
+        for (j = 0; keywords[j]; j++)
+            lang->keywordStart[(unsigned char)keywords[j][0] >> 3] |= 1 << (keywords[j][0] & 7);
+        lang->prepared = 1;
+    }
+    //the first char of a delimiter is tested before the rest is compared
+    while (i < size) {
+        unsigned char c = s[i];
+
+        if (scsLen && c == (unsigned char)scs[0] && !inString && !inComment &&
+            i + scsLen <= size && !strncmp(&s[i], scs, scsLen)) {
+            syntaxMark(hl, i, size - i, HL_COMMENT);
+            break;
+        }
+        if (mcsLen && mceLen && !inString) {
+            if (inComment) {
+                prevHl = HL_MLCOMMENT;
+                if (c == (unsigned char)mce[0] && i + mceLen <= size &&
+                    !strncmp(&s[i], mce, mceLen)) {
+                    syntaxMark(hl, i, mceLen, HL_MLCOMMENT);
+                    i += mceLen;
+                    inComment = 0;
+                    prevSep = 1;
+                } else {
+                    syntaxMark(hl, i++, 1, HL_MLCOMMENT);
+                }
+                continue;
+            } else if (c == (unsigned char)mcs[0] && i + mcsLen <= size &&
+                       !strncmp(&s[i], mcs, mcsLen)) {
+                syntaxMark(hl, i, mcsLen, HL_MLCOMMENT);
+                prevHl = HL_MLCOMMENT;
+                i += mcsLen;
+                inComment = 1;
+                continue;
+            }
+        }
+        if (lang->flags & HL_HIGHLIGHT_STRINGS) {
+            if (inString) {
+                syntaxMark(hl, i, 1, HL_STRING);
+                prevHl = HL_STRING;
+                if (c == '\\' && i + 1 < size) {
+                    syntaxMark(hl, i + 1, 1, HL_STRING);
+                    i += 2;
+                    continue;
+                }
+                if (c == inString) inString = 0;
+                i++;
+                prevSep = 1;
+                continue;
+            } else if (c == '"' || c == '\'') {
+                inString = c;
+                syntaxMark(hl, i++, 1, HL_STRING);
+                prevHl = HL_STRING;
+                continue;
+            }
+        }
+        if (lang->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit(c) && (prevSep || prevHl == HL_NUMBER)) ||
+                (c == '.' && prevHl == HL_NUMBER)) {
+                syntaxMark(hl, i++, 1, HL_NUMBER);
+                prevHl = HL_NUMBER;
+                prevSep = 0;
+                continue;
+            }
+        }
+        if (prevSep && (lang->keywordStart[c >> 3] & (1 << (c & 7)))) {
+            for (j = 0; keywords[j]; j++) {
+                if (keywords[j][0] != c) continue;
+                int klen = strlen(keywords[j]);
+                int kw2 = keywords[j][klen - 1] == '|';
+                if (kw2) klen--;
+                if (i + klen <= size && !strncmp(&s[i], keywords[j], klen) &&
+                    (i + klen == size || sep[(unsigned char)s[i + klen]])) {
+                    prevHl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+                    syntaxMark(hl, i, klen, prevHl);
+                    i += klen;
+                    break;
+                }
+            }
+            if (keywords[j] != NULL) {
+                prevSep = 0;
+                continue;
+            }
+        }
+        syntaxMark(hl, i++, 1, HL_NORMAL);
+        prevHl = HL_NORMAL;
+        prevSep = sep[c];
+    }
+    return inComment ? HL_STATE_COMMENT : HL_STATE_NORMAL;
+}
+
+/**
+ * Called when row at changes: the lexer state of the rows from at on has to
+ * be checked again before they are drawn.
+ */
+void editorSyntaxInvalidate(int at) {
+    if (at < editC.syntax.valid) editC.syntax.valid = at;
+}
+
+/**
+ * Lexes a row again from state. Its highlight array is kept up to date if it
+ * has one; rows that are not drawn only need their end state.
+ */
+void editorSyntaxRow(erow *row, unsigned char state) {
+    struct rowExtra *ex = row->extra;
+
+    if (ex && ex->hl && ex->hlSize != row->size + 1) {
+        ex->hl = slabRealloc(&editC.slab, ex->hl, ex->hlSize, row->size + 1);
+        ex->hlSize = row->size + 1;
+    }
+    row->hlStart = state;
+    row->hlEnd = syntaxLex(editC.syntax.lang, rowChars(row), row->size, state, ex ? ex->hl : NULL);
+    row->marks |= ROW_HL_VALID;
+}
+
+/**
+ * Lexes every line of a block from state, reading a lazy one straight from
+ * the mapped text, and returns the state after the last. The state of each
+ * row goes to rows if not NULL.
+ */
+unsigned char syntaxLexBlock(rowBlock *blk, unsigned char state, erow *rows) {
+    int j;
+
+    for (j = 0; j < blk->count; j++) {
+        long len;
+        const char *line = blockLine(blk, j, &len);
+        unsigned char end = syntaxLex(editC.syntax.lang, line, len, state, NULL);
+        if (rows) {
+            rows[j].hlStart = state;
+            rows[j].hlEnd = end;
+            rows[j].marks |= ROW_HL_VALID;
+        }
+        state = end;
+    }
+    return state;
+}
+
+/**
+ * Returns the lexer state row at, up to editC.syntax.valid, starts in: the
+ * end state of the row before, or of its block if that is still lazy.
+ */
+unsigned char syntaxStateAt(struct textStore *ts, int at) {
+    int idx, b;
+
+    if (at == 0) return HL_STATE_NORMAL;
+    b = storeLocate(ts, at, &idx);
+    if (idx == 0 && !ts->blocks[b - 1]->rows) return ts->blocks[b - 1]->hlEnd;
+    return editorRowAt(at - 1)->hlEnd;
+}
+
+/**
+ * Brings the lexer state of rows [0, last] up to date. Rows before
+ * editC.syntax.valid already are; from there, a row is lexed again only if it
+ * was edited or the row before now ends in another state. Once a row ends in
+ * the same state as before, the rows after it cost a flag test each, so
+ * typing re-lexes one row unless it opens or closes a comment.
+ * Lazy blocks are lexed whole from the mapped text, keeping only the state
+ * they start and end in, so going to the end of a big file makes no rows for
+ * the blocks on the way; storeMaterialize() gives their rows the states once
+ * they are drawn.
+ */
+void editorSyntaxUpdate(int last) {
+    struct textStore *ts = &editC.text;
+    int at = editC.syntax.valid, idx, b;
+    unsigned char state;
+
+    if (!editC.syntax.lang) return;
+    if (last >= editC.num_rows) last = editC.num_rows - 1;
+    if (at > last) return;
+    state = syntaxStateAt(ts, at);
+    for (b = storeLocate(ts, at, &idx); at <= last; b++, idx = 0) {
+        rowBlock *blk = ts->blocks[b];
+        if (!blk->rows) {
+            //a lazy block is only ever passed whole, so idx is 0 here
+            if (!blk->hlValid || blk->hlStart != state) {
+                blk->hlStart = state;
+                blk->hlEnd = syntaxLexBlock(blk, state, NULL);
+                blk->hlValid = 1;
+            }
+            state = blk->hlEnd;
+            at += blk->count - idx;
+            continue;
+        }
+        for (; idx < blk->count && at <= last; idx++, at++) {
+            erow *row = &blk->rows[idx];
+            if (!(row->marks & ROW_HL_VALID) || row->hlStart != state) editorSyntaxRow(row, state);
+            state = row->hlEnd;
+        }
+    }
+    editC.syntax.valid = at;
+}
+
+/**
+ * Picks the highlight of the file from its name. Rows lexed for another
+ * kind of file are lexed again.
+ */
+void editorSelectSyntax() {
+    struct editorSyntax *lang = NULL;
+    unsigned j, i;
+    int b, k;
+
+    if (editC.filename) {
+        char *ext = strrchr(editC.filename, '.');
+        for (j = 0; j < HLDB_ENTRIES && !lang; j++) {
+            for (i = 0; HLDB[j].filematch[i] && !lang; i++) {
+                char *m = HLDB[j].filematch[i];
+                int isExt = m[0] == '.';
+                if ((isExt && ext && !strcmp(ext, m)) || (!isExt && strstr(editC.filename, m)))
+                    lang = &HLDB[j];
+            }
+        }
+    }
+    if (lang != editC.syntax.lang && editC.syntax.lang) {
+        for (b = 0; b < editC.text.nblocks; b++) {
+            rowBlock *blk = editC.text.blocks[b];
+            blk->hlValid = 0;
+            if (blk->rows)
+                for (k = 0; k < blk->count; k++) blk->rows[k].marks &= ~ROW_HL_VALID;
+        }
+    }
+    editC.syntax.lang = lang;
+    editC.syntax.valid = 0;
+}
+
+/**
+ * Returns the SGR color of a highlight class.
+ */
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36;
+        case HL_KEYWORD1: return 33;
+        case HL_KEYWORD2: return 32;
+        case HL_STRING: return 35;
+        case HL_NUMBER: return 31;
+        default: return 39;
+    }
+}
+
+/** ======================== UTF-8 decoding and display widths. ===================*/
+
+// Code points below this have their display width in widthTable; the planes
+// above it are all one column wide but for a few ranges, see utf8CharWidth().
+#define WIDTH_TABLE_END 0x20000
+
+// Double width characters: East Asian wide and fullwidth forms, and emoji
+// shown as pictures.
+static const unsigned widthWide[][2] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B},
+    {0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320},
+    {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+    {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E},
+    {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+    {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+    {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+    {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+};
+
+// Characters that take no column of their own: combining marks, which are
+// drawn on the character before them, and invisible format characters.
+// Applied after widthWide, which some of them fall into.
+static const unsigned widthZero[][2] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+    {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x0819}, {0x081B, 0x0823},
+    {0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B}, {0x08D3, 0x08E1},
+    {0x08E3, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948},
+    {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981},
+    {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD}, {0x09E2, 0x09E3},
+    {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A42}, {0x0A47, 0x0A48},
+    {0x0A4B, 0x0A4D}, {0x0A70, 0x0A71}, {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC},
+    {0x0AC1, 0x0AC5}, {0x0AC7, 0x0AC8}, {0x0ACD, 0x0ACD}, {0x0B01, 0x0B01},
+    {0x0B3C, 0x0B3C}, {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B4D},
+    {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD}, {0x0C3E, 0x0C40},
+    {0x0C46, 0x0C48}, {0x0C4A, 0x0C4D}, {0x0C55, 0x0C56}, {0x0CBC, 0x0CBC},
+    {0x0CCC, 0x0CCD}, {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D}, {0x0DCA, 0x0DCA},
+    {0x0DD2, 0x0DD4}, {0x0DD6, 0x0DD6}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A},
+    {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39},
+    {0x0F71, 0x0F7E}, {0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0FBC},
+    {0x0FC6, 0x0FC6}, {0x102D, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103A},
+    {0x1058, 0x1059}, {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714},
+    {0x1732, 0x1734}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17B4, 0x17B5},
+    {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x17DD, 0x17DD},
+    {0x180B, 0x180E}, {0x18A9, 0x18A9}, {0x1920, 0x1922}, {0x1927, 0x1928},
+    {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18}, {0x1AB0, 0x1AFF},
+    {0x1B00, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C},
+    {0x1B42, 0x1B42}, {0x1B6B, 0x1B73}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+    {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x2CEF, 0x2CF1},
+    {0x2DE0, 0x2DFF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672},
+    {0xA674, 0xA67D}, {0xA69E, 0xA69F}, {0xA6F0, 0xA6F1}, {0xA802, 0xA802},
+    {0xA806, 0xA806}, {0xA80B, 0xA80B}, {0xA825, 0xA826}, {0xA8C4, 0xA8C5},
+    {0xA8E0, 0xA8F1}, {0xA926, 0xA92D}, {0xA947, 0xA951}, {0xA980, 0xA982},
+    {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9}, {0xA9BC, 0xA9BC}, {0xAA29, 0xAA2E},
+    {0xAA31, 0xAA32}, {0xAA35, 0xAA36}, {0xAA43, 0xAA43}, {0xAA4C, 0xAA4C},
+    {0xAAB0, 0xAAB0}, {0xAAB2, 0xAAB4}, {0xAAB7, 0xAAB8}, {0xAABE, 0xAABF},
+    {0xAAC1, 0xAAC1}, {0xABE5, 0xABE5}, {0xABE8, 0xABE8}, {0xABED, 0xABED},
+    {0xD7B0, 0xD7FF}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0x101FD, 0x101FD}, {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F},
+    {0x11001, 0x11001}, {0x11038, 0x11046}, {0x1107F, 0x11081}, {0x110B3, 0x110B6},
+    {0x110B9, 0x110BA}, {0x1D167, 0x1D169}, {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B},
+    {0x1D1AA, 0x1D1AD}, {0x1F3FB, 0x1F3FF},
+};
+
+// Display width of every code point below WIDTH_TABLE_END, two bits each,
+// filled from the range lists on first use.
+static unsigned char widthTable[WIDTH_TABLE_END / 4];
+
+void widthTableSet(const unsigned (*ranges)[2], size_t n, unsigned width) {
+    size_t i;
+    unsigned cp;
+
+    for (i = 0; i < n; i++) {
+        for (cp = ranges[i][0]; cp <= ranges[i][1] && cp < WIDTH_TABLE_END; cp++) {
+            int shift = (cp & 3) * 2;
+            widthTable[cp >> 2] = (widthTable[cp >> 2] & ~(3 << shift)) | width << shift;
+        }
+    }
+}
+
+/**
+ * Returns how many columns a code point takes on a terminal: 2 for wide CJK
+ * and emoji, 0 for combining marks, 1 for the rest.
+ */
+int utf8CharWidth(unsigned cp) {
+    static int ready = 0;
+
+    if (cp < 0x300) return 1;
+    if (cp < WIDTH_TABLE_END) {
+        if (!ready) {
+            //every code point is one column wide unless a list says otherwise
+            memset(widthTable, 0x55, sizeof(widthTable));
+            widthTableSet(widthWide, sizeof(widthWide) / sizeof(widthWide[0]), 2);
+            widthTableSet(widthZero, sizeof(widthZero) / sizeof(widthZero[0]), 0);
+            ready = 1;
+        }
+        return (widthTable[cp >> 2] >> (cp & 3) * 2) & 3;
+    }
+    if ((cp >= 0x20000 && cp <= 0x2FFFD) || (cp >= 0x30000 && cp <= 0x3FFFD)) return 2;
+    if ((cp >= 0xE0001 && cp <= 0xE007F) || (cp >= 0xE0100 && cp <= 0xE01EF)) return 0;
+    return 1;
+}
+
+/**
+ * Decodes the UTF-8 sequence at s, of at most n bytes, into *cp. Returns its
+ * length, or 0 if s does not start a valid sequence: a continuation byte, an
+ * overlong or cut off sequence, a surrogate or a code point past U+10FFFF.
+ */
+int utf8Decode(const char *s, long n, unsigned *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    unsigned c = u[0];
+    int len, k;
+
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    if (c < 0xC2) return 0;
+    else if (c < 0xE0) len = 2, c &= 0x1F;
+    else if (c < 0xF0) len = 3, c &= 0x0F;
+    else if (c < 0xF5) len = 4, c &= 0x07;
+    else return 0;
+    if (n < len) return 0;
+    for (k = 1; k < len; k++) {
+        if ((u[k] & 0xC0) != 0x80) return 0;
+        c = (c << 6) | (u[k] & 0x3F);
+    }
+    if ((len == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) ||
+        (len == 4 && (c < 0x10000 || c > 0x10FFFF)))
+        return 0;
+    *cp = c;
+    return len;
+}
+
+/**
+ * Returns where the character byte at of the size bytes at s belongs to
+ * starts: at itself, unless it is the continuation of a valid sequence that
+ * starts up to 3 bytes before.
+ */
+long utf8Start(const char *s, long size, long at) {
+    unsigned cp;
+    long k;
+
+    for (k = 0; k <= 3 && k <= at; k++) {
+        if (((unsigned char)s[at - k] & 0xC0) != 0x80)
+            return utf8Decode(&s[at - k], size - (at - k), &cp) > k ? at - k : at;
+    }
+    return at;
+}
+
+/**
+ * Returns the columns byte at of the size bytes at s adds, and in *len how
+ * many bytes to step over. A character is counted at its first byte, so a
+ * walk may start at any byte. A byte that is not valid UTF-8 takes one column
+ * as it is shown as U+FFFD. Tabs are left to the caller.
+ */
+int utf8Width(const char *s, long size, long at, int *len) {
+    unsigned cp;
+
+    if (((unsigned char)s[at] & 0xC0) == 0x80) {
+        long start = utf8Start(s, size, at);
+        *len = start < at ? start + utf8Decode(&s[start], size - start, &cp) - at : 1;
+        return start < at ? 0 : 1;
+    }
+    *len = utf8Decode(&s[at], size - at, &cp);
+    if (*len == 0) {
+        *len = 1;
+        return 1;
+    }
+    return utf8CharWidth(cp);
+}
+
+/**
+ * Portable version of textPlainSpan().
+ */
+long textPlainSpanScalar(const char *s, long n) {
+    long i = 0;
+
+    while (i < n && (unsigned char)s[i] < 0x80 && s[i] != '\t') i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * SSE2 version, for n of 16 or more: a byte is plain unless its top bit is
+ * set or it equals a tab, so OR-ing the bytes with their tab compare leaves
+ * the sign bits of the bytes that are not, 16 at a time. The last few bytes
+ * are checked with one load that overlaps the bytes already known plain.
+ */
+__attribute__((target("sse2")))
+long textPlainSpanSSE2(const char *s, long n) {
+    const __m128i tab = _mm_set1_epi8('\t');
+    __m128i v;
+    unsigned mask;
+    long pos = 0;
+
+    for (; pos + 16 <= n; pos += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + pos));
+        mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    if (pos < n) {
+        v = _mm_loadu_si128((const __m128i *)(s + n - 16));
+        mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)));
+        if (mask) return n - 16 + __builtin_ctz(mask);
+    }
+    return n;
+}
+
+/**
+ * AVX2 version: same as the SSE2 one, 32 bytes at a time. It does not call
+ * the SSE2 one for the rest, as mixing the two encodings stalls.
+ */
+__attribute__((target("avx2")))
+long textPlainSpanAVX2(const char *s, long n) {
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m128i tab16 = _mm_set1_epi8('\t');
+    __m256i v;
+    __m128i a, b;
+    unsigned mask;
+    long pos = 0;
+
+    for (; pos + 32 <= n; pos += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + pos));
+        mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, tab)));
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    if (pos == n) return n;
+    if (n >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+        mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, tab)));
+        return mask ? n - 32 + __builtin_ctz(mask) : n;
+    }
+    //16 to 31 bytes: the first 16 and the last 16
+    a = _mm_loadu_si128((const __m128i *)s);
+    b = _mm_loadu_si128((const __m128i *)(s + n - 16));
+    mask = _mm_movemask_epi8(_mm_or_si128(a, _mm_cmpeq_epi8(a, tab16)));
+    if (mask) return __builtin_ctz(mask);
+    mask = _mm_movemask_epi8(_mm_or_si128(b, _mm_cmpeq_epi8(b, tab16)));
+    return mask ? n - 16 + __builtin_ctz(mask) : n;
+}
+#endif
+
+typedef long (*plainScanner)(const char *, long);
+
+/**
+ * Picks the widest version of textPlainSpan() the CPU supports, once.
+ */
+plainScanner textPlainSpanImpl() {
+    static plainScanner impl = NULL;
+
+    if (impl) return impl;
+    impl = textPlainSpanScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) impl = textPlainSpanAVX2;
+    else if (__builtin_cpu_supports("sse2")) impl = textPlainSpanSSE2;
+#endif
+    return impl;
+}
+
+/**
+ * Returns how many of the n bytes at s are plain ASCII, one column each,
+ * before the first tab or non-ASCII byte. Rendering and column counting
+ * skip such runs without decoding them, which for most files is all of it.
+ */
+long textPlainSpan(const char *s, long n) {
+    if (n < 16) return textPlainSpanScalar(s, n);
+    return textPlainSpanImpl()(s, n);
+}
+
+/**
+ * Makes a cell show the single byte c. The cell is written in place rather
+ * than built and copied, as copying it right after its bytes were stored one
+ * by one stalls on store forwarding.
+ */
+static inline void cellSet(scell *cell, char c, unsigned char attr) {
+    memset(cell, 0, sizeof(*cell));
+    cell->ch[0] = c;
+    cell->attr = attr;
+}
+
+/**
+ * Draws the character at byte at of the size bytes at s into cells from
+ * *x on, at most limit, and moves *x past it; returns the bytes it takes.
+ * A wide character takes a second CELL_WIDE_TAIL cell, and is drawn as a
+ * blank where only one is left. A zero width one goes into the cell before
+ * it, or is left out at the start or if it has no visible form. A byte that
+ * is not valid UTF-8 and a C1 control are drawn as U+FFFD.
+ */
+int utf8Draw(scell *cells, int *x, int limit, const char *s, long size, long at) {
+    unsigned cp;
+    int len = utf8Decode(&s[at], size - at, &cp), k;
+    int w = len ? utf8CharWidth(cp) : 1;
+
+    if (len == 0 || cp < 0xA0) {
+        scell bad = {"\xEF\xBF\xBD", 0};
+        cells[(*x)++] = bad;
+        return len ? len : 1;
+    }
+    if (w == 0) {
+        int prev = *x - 1, used;
+        if (prev >= 0 && cells[prev].ch[0] == CELL_WIDE_TAIL && prev > 0) prev--;
+        if (prev < 0 || (cp >= 0x200B && cp <= 0x206F) || cp == 0xFEFF) return len;
+        for (used = 0; used < (int)sizeof(cells->ch) && cells[prev].ch[used]; used++);
+        if (used + len <= (int)sizeof(cells->ch)) memcpy(&cells[prev].ch[used], &s[at], len);
+        return len;
+    }
+    if (w == 2 && *x + 2 > limit) {
+        cells[(*x)++] = cellBlank;
+        return len;
+    }
+    cellSet(&cells[*x], s[at], 0);
+    for (k = 1; k < len; k++) cells[*x].ch[k] = s[at + k];
+    (*x)++;
+    if (w == 2) cellSet(&cells[(*x)++], CELL_WIDE_TAIL, 0);
+    return len;
+}
+
+/** ======================== All Editor row manipulation functions  . ===================*/
+
+/**
+ * Returns the render column reached after chars [from, to) of a row, when
+ * char from is at render column rx. A multi-byte character counts at its
+ * first byte, see utf8Width().
+ */
+long rowWalkRx(erow *row, long from, long to, long rx) {
+    const char *chars = rowChars(row);
+    int len;
+
+    //plain ASCII takes one column a byte, so only tabs and the bytes of
+    //other characters are looked at one by one
+    while (from < to) {
+        unsigned char c = chars[from];
+        if (c >= 0x80) {
+            rx += utf8Width(chars, row->size, from, &len);
+            from += len;
+        } else if (c == '\t') {
+            rx += SMEDITOR_TAB_STOP - (rx % SMEDITOR_TAB_STOP);
+            from++;
+        } else {
+            long run = textPlainSpan(&chars[from], to - from);
+            rx += run;
+            from += run;
+        }
+    }
+    return rx;
+}
+
+/**
+ * Returns the chars index of the character after the one at cx, and of the
+ * zero width ones that follow it, like combining accents, so the cursor
+ * moves over what the screen shows as one character.
+ */
+long editorRowNextChar(erow *row, long cx) {
+    const char *chars = rowChars(row);
+    int len;
+
+    if (cx >= row->size) return row->size;
+    utf8Width(chars, row->size, cx, &len);
+    cx += len;
+    while (cx < row->size && (unsigned char)chars[cx] >= 0x80 &&
+           utf8Width(chars, row->size, cx, &len) == 0)
+        cx += len;
+    return cx;
+}
+
+/**
+ * Returns the chars index of the character before cx, see editorRowNextChar().
+ */
+long editorRowPrevChar(erow *row, long cx) {
+    const char *chars = rowChars(row);
+    int len;
+
+    while (cx > 0) {
+        cx = utf8Start(chars, row->size, cx - 1);
+        if ((unsigned char)chars[cx] < 0x80 || utf8Width(chars, row->size, cx, &len) != 0)
+            break;
+    }
+    return cx;
+}
+
+void colIndexFree(struct colIndex *ci) {
+    if (!ci) return;
+    slabFree(&editC.slab, ci->rx, sizeof(long) * ci->cap);
+    slabFree(&editC.slab, ci, sizeof(struct colIndex));
+}
+
+/**
+ * Makes checkpoints [0, k] of a long row up to date, computing the missing
+ * ones from the last one that is.
+ */
+struct colIndex *colIndexExtend(erow *row, int k) {
+    struct rowExtra *ex = rowExtraGet(row);
+    struct colIndex *ci = ex->cols;
+
+    if (!ci) {
+        ci = ex->cols = slabAlloc(&editC.slab, sizeof(struct colIndex));
+        memset(ci, 0, sizeof(*ci));
+    }
+    if (k >= ci->cap) {
+        int cap = k + 1 > ci->cap * 2 ? k + 1 : ci->cap * 2;
+        ci->rx = slabRealloc(&editC.slab, ci->rx, sizeof(long) * ci->cap, sizeof(long) * cap);
+        ci->cap = cap;
+    }
+    if (ci->n == 0) ci->rx[ci->n++] = 0;
+    for (; ci->n <= k; ci->n++) {
+        long from = (long)(ci->n - 1) * COL_CHECKPOINT;
+        ci->rx[ci->n] = rowWalkRx(row, from, from + COL_CHECKPOINT, ci->rx[ci->n - 1]);
+    }
+    return ci;
+}
+
+/**
+ * calculate the value of editC.rx properly in editorScroll().
+ * editorRowCxToRx() function converts a chars index into a render index.
+ * loop through all the characters to the left of cx, and figure out how many
+ * spaces each tab takes up. A long row starts from the checkpoint just before
+ * cx, so this walks at most COL_CHECKPOINT chars.*/
+long editorRowCxToRx(erow *row, long cx) {
+    if (row->size < COL_INDEX_MIN || cx < COL_CHECKPOINT) return rowWalkRx(row, 0, cx, 0);
+    if (cx > row->size) cx = row->size;
+    int k = cx / COL_CHECKPOINT;
+    struct colIndex *ci = colIndexExtend(row, k);
+    return rowWalkRx(row, (long)k * COL_CHECKPOINT, cx, ci->rx[k]);
+}
+
+/**
+ * Converts a render index into a chars index: returns the char shown at
+ * render column rx, or the length of the row if rx is past its end. A long row
+ * finds the last checkpoint at or before rx by binary search.
+ */
+long editorRowRxToCx(erow *row, long rx) {
+    long cx = 0, cur = 0, next;
+
+    if (row->size >= COL_INDEX_MIN) {
+        struct colIndex *ci = colIndexExtend(row, 0);
+        int last = (row->size - 1) / COL_CHECKPOINT;
+        //checkpoints are computed as far as rx, or the end of the row
+        while (ci->n <= last && ci->rx[ci->n - 1] <= rx)
+            colIndexExtend(row, ci->n + 15 < last ? ci->n + 15 : last);
+        int lo = 0, hi = ci->n - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (ci->rx[mid] <= rx) lo = mid;
+            else hi = mid - 1;
+        }
+        cx = (long)lo * COL_CHECKPOINT;
+        cur = ci->rx[lo];
+    }
+    for (; cx < row->size; cx++, cur = next) {
+        next = rowWalkRx(row, cx, cx + 1, cur);
+        if (next > rx) return cx;
+    }
+    return cx;
+}
+
+/**
+ * Called whenever the chars of a row change from index at on. The render
+ * string and the highlight are not rebuilt here, only marked stale: they are
+ * rebuilt if and when the row is drawn again. Column checkpoints up to 3
+ * bytes before at stay valid; a UTF-8 sequence starting in those bytes may
+ * have gained or lost the bytes that made it one character.
+ */
+void editorUpdateRowFrom(erow *row, long at) {
+    struct colIndex *ci = row->extra ? row->extra->cols : NULL;
+    long keep = at > 3 ? at - 3 : 0;
+
+    row->marks |= ROW_RENDER_STALE;
+    row->marks &= ~ROW_HL_VALID;
+    if (ci && ci->n > keep / COL_CHECKPOINT + 1) ci->n = keep / COL_CHECKPOINT + 1;
+}
+
+void editorUpdateRow(erow *row) {
+    editorUpdateRowFrom(row, 0);
+}
+
+/**
+ * Picks a slot for a row that has none with the CLOCK algorithm: the hand
+ * skips slots used since it last passed them, clearing their mark, so rows
+ * drawn every frame stay cached and eviction is O(1) amortized.
+ */
+int renderCacheEvict(struct renderCache *rc) {
+    if (rc->nslots == 0) {
+        rc->nslots = editC.screen_rows * 4;
+        if (rc->nslots < RENDER_CACHE_MIN_SLOTS) rc->nslots = RENDER_CACHE_MIN_SLOTS;
+        rc->slots = calloc(rc->nslots, sizeof(struct renderSlot));
+    }
+    while (1) {
+        struct renderSlot *slot = &rc->slots[rc->hand];
+        int s = rc->hand;
+        rc->hand = (rc->hand + 1) % rc->nslots;
+        if (!slot->ref) return s;
+        slot->ref = 0;
+    }
+}
+
+/**
+ * Makes room for at least nslots slots, e.g. after the terminal grew. Rows
+ * keep their slot numbers, so existing render strings stay valid.
+ */
+void renderCacheResize(struct renderCache *rc, int nslots) {
+    if (rc->nslots == 0 || nslots <= rc->nslots) return;
+    rc->slots = realloc(rc->slots, sizeof(struct renderSlot) * nslots);
+    memset(&rc->slots[rc->nslots], 0, sizeof(struct renderSlot) * (nslots - rc->nslots));
+    rc->nslots = nslots;
+}
+
+/**
+ * This function uses the chars string of an erow to fill in the contents
+ * of the render string, in the slot given to it by the render cache: one
+ * screen cell per render column, with tabs expanded and UTF-8 decoded.
+ * A row of RENDER_WINDOW_MIN chars or more is only rendered around the width
+ * columns from render column from, starting at the char the column index
+ * finds there, so a giant line costs what the screen shows.
+ */
+void renderCacheFill(struct renderSlot *slot, erow *row, long from, int width) {
+    const char *chars = rowChars(row);
+    long cx = 0, rx = 0, end;
+    int idx = 0, k, len;
+
+    if (row->size >= RENDER_WINDOW_MIN) {
+        long start = from > RENDER_WINDOW_MARGIN ? from - RENDER_WINDOW_MARGIN : 0;
+        end = from + width + RENDER_WINDOW_MARGIN;
+        cx = editorRowRxToCx(row, start);
+        rx = editorRowCxToRx(row, cx);
+    } else {
+        //the render length is the render column of the end of the row, which
+        //the column index of a long row knows without walking all of it again
+        end = editorRowCxToRx(row, row->size);
+    }
+    int need = (int)(end - rx) + SMEDITOR_TAB_STOP + 1;
+    if (need > slot->cap) {
+        //grow geometrically so typing at the end of a line rarely reallocates
+        int cap = slot->cap ? slot->cap : 64;
+        while (cap < need) cap *= 2;
+        editC.rcache.bytes += sizeof(scell) * (cap - slot->cap);
+        slot->buf = realloc(slot->buf, sizeof(scell) * cap);
+        slot->cap = cap;
+    }
+
+    while (cx < row->size) {
+        //plain ASCII is one cell a byte, without decoding
+        //the scan stops at the window edge, so a long row costs its width
+        long run = 0, room = end - rx - idx, left = row->size - cx;
+        if (room > 0 && (unsigned char)chars[cx] < 0x80)
+            run = textPlainSpan(&chars[cx], left < room ? left : room);
+        for (k = 0; k < run; k++) cellSet(&slot->buf[idx + k], chars[cx + k], 0);
+        idx += run;
+        cx += run;
+        if (cx == row->size) break;
+        //past the end only the combining marks of the last cell are wanted
+        if (rx + idx >= end && ((unsigned char)chars[cx] < 0x80 ||
+                                utf8Width(chars, row->size, cx, &len) != 0))
+            break;
+        //if tab encountered fill up render with spaces instead
+        if (chars[cx] == '\t') {
+            do slot->buf[idx++] = cellBlank; while ((rx + idx) % SMEDITOR_TAB_STOP != 0);
+            cx++;
+        } else {
+            cx += utf8Draw(slot->buf, &idx, slot->cap, chars, row->size, cx);
+        }
+    }
+    slot->len = idx;
+    slot->rxStart = rx;
+    slot->complete = cx == row->size;
+}
+
+/**
+ * Returns the rendered cells of a row from render column from on, and in
+ * *rsize how many columns of it there are, at least width unless the row ends
+ * first. The string is built first if the row is not in the cache, was edited
+ * since, or only has another window of a long row rendered. An edited row is
+ * re-rendered into the slot it already owns, so typing does not allocate.
+ * The string stays valid until the next call for another row may evict it.
+ */
+scell *editorRowRender(erow *row, long from, int width, int *rsize) {
+    struct renderCache *rc = &editC.rcache;
+    struct rowExtra *ex = rowExtraGet(row);
+    struct renderSlot *slot;
+
+    if (ex->rgen != 0 && ex->rslot < rc->nslots && rc->slots[ex->rslot].gen == ex->rgen) {
+        slot = &rc->slots[ex->rslot];
+        if ((row->marks & ROW_RENDER_STALE) || from < slot->rxStart ||
+            (!slot->complete && from + width > slot->rxStart + slot->len))
+            renderCacheFill(slot, row, from, width);
+    } else {
+        static unsigned gen = 0;
+        ex->rslot = renderCacheEvict(rc);
+        slot = &rc->slots[ex->rslot];
+        if (++gen == 0) gen = 1;
+        slot->gen = ex->rgen = gen;
+        renderCacheFill(slot, row, from, width);
+    }
+    row->marks &= ~ROW_RENDER_STALE;
+    slot->frame = rc->frame;
+    slot->ref = 1;
+    long left = slot->rxStart + slot->len - from;
+    if (left <= 0) {
+        *rsize = 0;
+        return slot->buf;
+    }
+    *rsize = left;
+    return &slot->buf[from - slot->rxStart];
+}
+
+/**
+ * Frees the buffers of slots not used in the last frame while the cache is
+ * over its byte budget, e.g. after scrolling past a few very long lines.
+ */
+void renderCacheTrim(struct renderCache *rc) {
+    int s;
+
+    for (s = 0; s < rc->nslots && rc->bytes > RENDER_CACHE_BUDGET; s++) {
+        struct renderSlot *slot = &rc->slots[s];
+        if (slot->frame == rc->frame || slot->cap == 0) continue;
+        rc->bytes -= sizeof(scell) * slot->cap;
+        free(slot->buf);
+        memset(slot, 0, sizeof(*slot));
+    }
+    rc->frame++;
+}
+
+/**
+ * Gives a row borrowed from the mapped file its own copy of the text, so that
+ * it can be edited. Must be called before anything writes to the text.
+ */
+void editorRowOwn(erow *row) {
+    if (!(row->flags & ROW_BORROWED)) return;
+    rowSetText(row, rowChars(row), row->size);
+}
+
+/**
+ * Inserts a row at the specified index
+ *
+ */
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > editC.num_rows) return;
+
+    //s may be the text of a short row, which moves when the store makes room,
+    //so it is copied first
+    erow new;
+    new.flags = 0;
+    new.marks = 0;
+    new.extra = NULL;
+    rowSetText(&new, s, len);
+
+    // the text store makes room for the new row by shifting at most one block
+    *storeInsertRow(&editC.text, at) = new;
+    editorSyntaxInvalidate(at);
+
+    editC.num_rows++;
+    editC.dirtyFlag++;
+}
+
+/**
+ * Frees memory held for row and char array
+ *
+ */
+void editorFreeRow(erow *row) {
+    rowFree(row);
+}
+/**
+ * free the memory owned by the row using editorFreeRow(). Then take the row out
+ * of the text store, which only shifts the rest of its block,
+ * and decrement numrows. Finally, we increment E.dirty.
+ */
+void editorDelRow(int at) {
+    if(at < 0 || at >= editC.num_rows) return;
+    editorFreeRow(editorRowEdit(at));
+    storeRemoveRow(&editC.text, at);
+    editC.num_rows--;
+    editC.dirtyFlag++;
+}
+/**
+ * Allows the user to edit the opened file, one char at a time.
+ */
+void editorInsertCharAt(erow *row, long at, int c) {
+    //validate at, which is the index we want to insert the character into
+    //at allowed to go past the end of the string in order to insert at the end
+    //of the row
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowOwn(row);
+    // make room for one more char (rowResize() keeps the null byte after it),
+    // and use memmove() to make room for the new character.
+    char *chars = rowResize(row, row->size + 1);
+    //use memmove to make room for the new char.
+    memmove(&chars[at + 1], &chars[at], row->size - at - 1);
+    chars[at] = c;
+    editorUpdateRowFrom(row, at);
+    editC.dirtyFlag++;
+}
+/**
+ * appends a string to the end of a row.
+ */
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    long at = row->size;
+
+    editorRowOwn(row);
+    //rows new size is row->size + len, and rowResize() adds the null byte.
+    char *chars = rowResize(row, at + len);
+    //memcpy the given string to the end of the contents of the row
+    memcpy(&chars[at], s, len);
+    editorUpdateRowFrom(row, at);
+    editC.dirtyFlag++;
+}
+
+/**
+ * Deletes a char from a row.
+ */
+void editorRowDelChar(erow *row, long at) {
+    if(at <0 || at >= row->size) return;
+    editorRowOwn(row);
+    char *chars = rowChars(row);
+    memmove(&chars[at], &chars[at+1],row->size - at - 1);
+    rowResize(row, row->size - 1);
+    editorUpdateRowFrom(row, at);
+    editC.dirtyFlag++;
+}
+/**
+ * Deletes len chars of a row, starting at at.
+ */
+void editorRowDelString(erow *row, long at, long len) {
+    if (at < 0 || len <= 0 || at + len > row->size) return;
+    editorRowOwn(row);
+    char *chars = rowChars(row);
+    memmove(&chars[at], &chars[at + len], row->size - at - len);
+    rowResize(row, row->size - len);
+    editorUpdateRowFrom(row, at);
+    editC.dirtyFlag++;
+}
+/** i==================================== editor operations. ===================
+ *  contains functions that we?ll call from editorProcessKeypress() when we?re
+ *  mapping keypresses to various text editing operations
+ */
+
+/**
+ * Returns 1, after telling the user, if an edit that adds a row at index at
+ * has to wait until the file is loaded. The lines still to come are appended
+ * after the last row, so a row made past the end of what is loaded so far
+ * would end up before them.
+ */
+int editorLoadingTail(int at) {
+    if (!editorLoading() || at < editC.num_rows) return 0;
+    editorSetStatusMsg("Still loading the file, try again when done.");
+    return 1;
+}
+
+void editorInsertChar(int c) {
+    if (editorLoadingTail(editC.cy)) return;
+    //If editC.cy == editC.numrows, then the cursor is on the tilde line after
+    //the end of the file, so we need to append a new row
+    int cont = 0;
+    if (editC.cy == editC.num_rows) {
+        undoPush(U_NEWROW, editC.cy, 0, NULL, 0);
+        editorInsertRow(editC.num_rows,"",0);
+        cont = U_CONT;
+    }
+    char ch = c;
+    undoPush(U_INSERT | cont, editC.cy, editC.cx, &ch, 1);
+    editorInsertCharAt(editorRowEdit(editC.cy), editC.cx, c);
+    editC.cx++;
+}
+
+/**
+ *
+ */
+void editorInsertNewline() {
+    if (editorLoadingTail(editC.cx == 0 ? editC.cy : editC.cy + 1)) return;
+    if (editC.cy == editC.num_rows) undoPush(U_NEWROW, editC.cy, 0, NULL, 0);
+    else undoPush(U_INSERT, editC.cy, editC.cx, "\n", 1);
+    if(editC.cx ==0) {
+        editorInsertRow(editC.cy,"",0);
+    } else {
+        //split the line we?re on into two rows
+        erow *row = editorRowAt(editC.cy);
+        //First we call editorInsertRow() and pass it the characters
+        //on the current row that are to the right of the cursor.
+        //That creates a new row after the current one, with the correct contents.
+        editorInsertRow(editC.cy + 1, &rowChars(row)[editC.cx], row->size - editC.cx);
+        //Then we reassign the row pointer, because editorInsertRow() may shift
+        //or split the block holding it, which invalidates the pointer
+        row = editorRowEdit(editC.cy);
+        editorRowOwn(row);
+        //we truncate the current row's contents by resizing it to the position
+        //of the cursor, and we call editorUpdateRowFrom() on the truncated row.
+        rowResize(row, editC.cx);
+        editorUpdateRowFrom(row, row->size);
+    }
+    editC.cy++;
+    editC.cx = 0;
+}
+
+/**
+ * Inserts a block of text at the cursor. The row under the cursor is split
+ * once and every line of the text becomes one new row, so this costs one row
+ * insertion per line instead of one edit per byte. Lines end in \n; with crlf
+ * set they may also end in \r\n or \r, as terminals send pasted newlines as \r.
+ */
+void editorInsertLines(const char *text, size_t len, int crlf) {
+    size_t pos = 0;
+    int cont = 0;
+
+    if (len == 0) return;
+    if (editC.cy == editC.num_rows) {
+        undoPush(U_NEWROW, editC.cy, 0, NULL, 0);
+        editorInsertRow(editC.num_rows, "", 0);
+        cont = U_CONT;
+    }
+    undoPush(U_INSERT | cont | (crlf ? U_CRLF : 0), editC.cy, editC.cx, text, len);
+
+    //the part of the current row right of the cursor goes after the text
+    erow *row = editorRowEdit(editC.cy);
+    editorRowOwn(row);
+    size_t tailLen = row->size - editC.cx;
+    char *tail = malloc(tailLen + 1);
+    memcpy(tail, &rowChars(row)[editC.cx], tailLen);
+    rowResize(row, editC.cx);
+
+    while (1) {
+        size_t end = pos;
+        while (end < len && text[end] != '\n' && (!crlf || text[end] != '\r')) end++;
+
+        row = editorRowEdit(editC.cy);
+        editorRowAppendString(row, (char *)&text[pos], end - pos);
+        editC.cx = row->size;
+        if (end == len) break;
+
+        pos = end + ((text[end] == '\r' && end + 1 < len && text[end + 1] == '\n') ? 2 : 1);
+        editorInsertRow(editC.cy + 1, "", 0);
+        editC.cy++;
+        editC.cx = 0;
+    }
+    editorRowAppendString(editorRowEdit(editC.cy), tail, tailLen);
+    free(tail);
+}
+
+/**
+ * Inserts pasted text at the cursor, see editorInsertLines().
+ */
+void editorInsertText(const char *text, size_t len) {
+    //a line break in the text adds rows after the cursor row
+    int breaks = memchr(text, '\n', len) || memchr(text, '\r', len);
+    if (editorLoadingTail(breaks ? editC.cy + 1 : editC.cy)) return;
+    editorInsertLines(text, len, 1);
+}
+
+void editorDelChar() {
+    //If editC.cy == editC.numrows, then the cursor is on the tilde line after
+    //the end of the file, so we need to append a new row
+    if (editC.cy == editC.num_rows) return;
+    //if the cursor is at the beginning of the first line, do nothing
+    if (editC.cx == 0 && editC.cy == 0) return;
+
+    erow *row = editorRowEdit(editC.cy);
+    if(editC.cx > 0) {
+        //take out the whole UTF-8 sequence before the cursor
+        long at = utf8Start(rowChars(row), row->size, editC.cx - 1);
+        undoPush(U_DELETE, editC.cy, at, &rowChars(row)[at], editC.cx - at);
+        editorRowDelString(row, at, editC.cx - at);
+        editC.cx = at;
+    } else {
+        erow *prev = editorRowEdit(editC.cy - 1);
+        undoPush(U_DELETE, editC.cy - 1, prev->size, "\n", 1);
+        editC.cx = prev->size;
+        editorRowAppendString(prev, rowChars(row), row->size);
+        editorDelRow(editC.cy);
+        editC.cy--;
+    }
+}
+
+/**
+ * Deletes len bytes of text at column col of row at, the end of a row
+ * counting as one byte, and leaves the cursor there. The rows the text spans
+ * are taken out from the last one up, so each removal only shifts the rows
+ * after it in its block.
+ */
+void editorDeleteText(int at, long col, size_t len) {
+    int last = at, k;
+    long endcol = col;
+    erow *row = editorRowAt(at);
+
+    //find where the text ends
+    while (len > (size_t)(row->size - endcol) && last + 1 < editC.num_rows) {
+        len -= row->size - endcol + 1;
+        row = editorRowAt(++last);
+        endcol = 0;
+    }
+    if (len > (size_t)(row->size - endcol)) len = row->size - endcol;
+    endcol += len;
+
+    if (last == at) {
+        editorRowDelString(editorRowEdit(at), col, endcol - col);
+    } else {
+        //what follows the text on its last row joins the first one
+        erow *first = editorRowEdit(at);
+        editorRowOwn(first);
+        rowResize(first, col);
+        row = editorRowAt(last);
+        editorRowAppendString(first, &rowChars(row)[endcol], row->size - endcol);
+        for (k = last; k > at; k--) editorDelRow(k);
+    }
+    editC.cy = at;
+    editC.cx = col;
+}
+/** ======================== Soft wrap ============================================ */
+/*
+ * With soft wrap on, a row of the text is folded into visual lines of
+ * screen_cols columns. Each block keeps the line count of its rows and the
+ * store keeps a Fenwick tree over the block totals, so a row maps to its first
+ * visual line and a visual line to its row in O(log n) plus a scan of one
+ * block. Blocks are laid out when a lookup lands in them: an edit only marks
+ * its row, see editorRowEdit(), and a resize makes every block stale at once,
+ * so only the blocks the screen and the cursor go through are measured again.
+ * Until then a block counts the lines it had, or one a row if it never was
+ * laid out, which keeps the tree consistent while the layout catches up.
+ */
+
+/**
+ * Returns the visual lines a row of the given render width takes at cols
+ * columns. An empty row still takes one.
+ */
+int wrapLines(long width, int cols) {
+    long lines = width ? (width + cols - 1) / cols : 1;
+    return lines > INT_MAX ? INT_MAX : lines;
+}
+
+/**
+ * Returns the visual lines row j of a block takes at cols columns. The rows
+ * of a lazy block are measured from the mapping, without making them rows.
+ */
+int wrapRowLines(rowBlock *blk, int j, int cols) {
+    erow row;
+    long len;
+
+    if (blk->rows) return wrapLines(editorRowCxToRx(&blk->rows[j], blk->rows[j].size), cols);
+    rowSetChars(&row, blockLine(blk, j, &len));
+    row.size = len;
+    row.flags = ROW_BORROWED;
+    row.marks = 0;
+    row.extra = NULL;
+    return wrapLines(rowWalkRx(&row, 0, len, 0), cols);
+}
+
+/**
+ * Lays out block b at cols columns, measuring only the rows that changed
+ * since it last was, or all of them if the width changed, and updates the
+ * visual line tree.
+ */
+void wrapLayout(struct textStore *ts, int b, int cols) {
+    rowBlock *blk = ts->blocks[b];
+    int j, all = blk->wrapCols != cols;
+    long sum = 0;
+
+    if (!all && !blk->wrapStale) return;
+    if (!blk->wrap) blk->wrap = malloc(sizeof(int) * ROW_BLOCK_CAP);
+    for (j = 0; j < blk->count; j++) {
+        if (all || blk->wrap[j] < 0) blk->wrap[j] = wrapRowLines(blk, j, cols);
+        sum += blk->wrap[j];
+    }
+    blk->wrapCols = cols;
+    blk->wrapStale = 0;
+    storeAdjustWrap(ts, b, sum - blk->vlines);
+}
+
+/**
+ * First visual line of block b: the sum of the line counts before it, read
+ * from the Fenwick tree, see storeBlockStart().
+ */
+long wrapBlockStart(struct textStore *ts, int b) {
+    long start = 0;
+
+    for (; b > 0; b -= b & -b) start += ts->wrapTree[b];
+    return start;
+}
+
+/**
+ * Returns the first visual line of row at, laying out its block first, and
+ * stores the lines of the row in lines if not NULL. Row num_rows, the line
+ * after the text, starts after the last visual line.
+ */
+long wrapLineOf(int at, int cols, int *lines) {
+    struct textStore *ts = &editC.text;
+    int idx, j, b = storeLocate(ts, at, &idx);
+
+    if (lines) *lines = 1;
+    if (b == ts->nblocks) {
+        if (b > 0) wrapLayout(ts, b - 1, cols);
+        return wrapBlockStart(ts, b);
+    }
+    wrapLayout(ts, b, cols);
+    long line = wrapBlockStart(ts, b);
+    for (j = 0; j < idx; j++) line += ts->blocks[b]->wrap[j];
+    if (lines) *lines = ts->blocks[b]->wrap[idx];
+    return line;
+}
+
+/**
+ * Finds the row visual line v belongs to by walking down the Fenwick tree,
+ * and stores which line of the row it is in seg. The block it lands in is laid
+ * out, and the walk done again if that moved v to another block. Returns
+ * num_rows, with seg 0, when v is past the last line.
+ */
+int wrapLocate(long v, int cols, long *seg) {
+    struct textStore *ts = &editC.text;
+
+    while (1) {
+        int pos = 0, step = 1, j, b;
+        long left = v;
+
+        if (ts->nblocks == 0) {
+            *seg = 0;
+            return editC.num_rows;
+        }
+        while (step * 2 <= ts->nblocks) step *= 2;
+        for (; step; step /= 2) {
+            if (pos + step <= ts->nblocks && ts->wrapTree[pos + step] <= left) {
+                pos += step;
+                left -= ts->wrapTree[pos];
+            }
+        }
+        b = pos < ts->nblocks ? pos : pos - 1;
+        rowBlock *blk = ts->blocks[b];
+        if (blk->wrapCols != cols || blk->wrapStale) {
+            wrapLayout(ts, b, cols);
+            continue;
+        }
+        if (pos == ts->nblocks) {
+            *seg = 0;
+            return editC.num_rows;
+        }
+        for (j = 0; left >= blk->wrap[j]; j++) left -= blk->wrap[j];
+        *seg = left;
+        return storeBlockStart(ts, pos) + j;
+    }
+}
+
+/**
+ * Returns the line of its row the cursor is on: the one its render column
+ * falls in, or the last one when it is just past the end of a full line.
+ */
+long wrapCursorSeg(int lines, int cols) {
+    long seg = editC.rx / cols;
+    return seg < lines ? seg : lines - 1;
+}
+
+/**
+ * Moves the cursor n visual lines down, or up if n is negative, keeping its
+ * column inside the line. The line it lands on comes from the layout tree, so
+ * this takes O(log n) however far it goes. Laying out the block it lands in
+ * can move the lines before it, in which case the move is worked out again.
+ */
+void wrapMoveCursor(long n) {
+    int cols = editC.screen_cols, lines, to;
+    erow *row = editC.cy < editC.num_rows ? editorRowAt(editC.cy) : NULL;
+    long from, target, seg;
+
+    editC.rx = row ? editorRowCxToRx(row, editC.cx) : 0;
+    do {
+        from = wrapLineOf(editC.cy, cols, &lines);
+        target = from + wrapCursorSeg(lines, cols) + n;
+        to = wrapLocate(target > 0 ? target : 0, cols, &seg);
+    } while (wrapLineOf(editC.cy, cols, NULL) != from);
+    editC.cy = to;
+    row = to < editC.num_rows ? editorRowAt(to) : NULL;
+    if (!row) {
+        editC.cx = 0;
+        return;
+    }
+    editC.cx = editorRowRxToCx(row, seg * cols + editC.rx % cols);
+    //a wide character across the start of the line belongs to the line before
+    if (editorRowCxToRx(row, editC.cx) < seg * cols) editC.cx = editorRowNextChar(row, editC.cx);
+}
+
+/** ======================== Newline scanning ====================================== */
+
+// Line index under construction: start offset of every line seen so far.
+struct lineIndex {
+    size_t *off;
+    size_t n;
+    size_t cap;
+    int crlf; //set when any line ends in \r\n
+};
+
+/**
+ * Makes sure there is room for at least extra more offsets, so the scanners
+ * below only check capacity once per block of bytes instead of once per line.
+ */
+void lineIndexReserve(struct lineIndex *li, size_t extra) {
+    if (li->n + extra <= li->cap) return;
+    while (li->n + extra > li->cap) li->cap = li->cap ? li->cap * 2 : 1024;
+    li->off = realloc(li->off, sizeof(size_t) * li->cap);
+}
+
+/**
+ * Records a newline found at position pos of text. The next line starts right
+ * after it, unless the newline is the last byte of the file.
+ */
+static inline void lineIndexNewline(struct lineIndex *li, const char *text,
+                                    size_t pos, size_t size) {
+    if (pos > 0 && text[pos - 1] == '\r') li->crlf = 1;
+    if (pos + 1 < size) li->off[li->n++] = pos + 1;
+}
+
+/**
+ * Portable scanner, used when the CPU has no vector unit we know about.
+ * memchr() is as fast as a byte loop gets without intrinsics.
+ */
+void scanNewlinesScalar(const char *text, size_t from, size_t to, size_t size,
+                        struct lineIndex *li) {
+    const char *p = text + from, *end = text + to;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+        lineIndexReserve(li, 1);
+        lineIndexNewline(li, text, nl - text, size);
+        p = nl + 1;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * SSE2 scanner: compares 16 bytes at a time against '\n' and walks the set
+ * bits of the resulting mask.
+ */
+__attribute__((target("sse2")))
+void scanNewlinesSSE2(const char *text, size_t from, size_t to, size_t size,
+                      struct lineIndex *li) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t pos = from;
+
+    for (; pos + 16 <= to; pos += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(text + pos));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (!mask) continue;
+        lineIndexReserve(li, 16);
+        while (mask) {
+            lineIndexNewline(li, text, pos + __builtin_ctz(mask), size);
+            mask &= mask - 1;
+        }
+    }
+    scanNewlinesScalar(text, pos, to, size, li);
+}
+
+/**
+ * AVX2 scanner: same as the SSE2 one, 32 bytes at a time.
+ */
+__attribute__((target("avx2")))
+void scanNewlinesAVX2(const char *text, size_t from, size_t to, size_t size,
+                      struct lineIndex *li) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t pos = from;
+
+    for (; pos + 32 <= to; pos += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(text + pos));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (!mask) continue;
+        lineIndexReserve(li, 32);
+        while (mask) {
+            lineIndexNewline(li, text, pos + __builtin_ctz(mask), size);
+            mask &= mask - 1;
+        }
+    }
+    scanNewlinesScalar(text, pos, to, size, li);
+}
+#endif
+
+typedef void (*newlineScanner)(const char *, size_t, size_t, size_t, struct lineIndex *);
+
+/**
+ * Picks the widest scanner the CPU we are running on supports.
+ */
+newlineScanner scanNewlinesImpl() {
+    static newlineScanner impl = NULL;
+
+    if (impl) return impl;
+    impl = scanNewlinesScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) impl = scanNewlinesAVX2;
+    else if (__builtin_cpu_supports("sse2")) impl = scanNewlinesSSE2;
+#endif
+    return impl;
+}
+
+// Files larger than this are split between threads, one chunk per thread.
+#define SCAN_CHUNK_MIN (64 << 20)
+#define SCAN_MAX_THREADS 8
+
+struct scanJob {
+    const char *text;
+    size_t from, to, size;
+    newlineScanner scan;
+    struct lineIndex li;
+};
+
+void *scanWorker(void *arg) {
+    struct scanJob *job = arg;
+    job->scan(job->text, job->from, job->to, job->size, &job->li);
+    return NULL;
+}
+
+/**
+ * Appends the start offsets of the lines beginning in [from, to) of text to li,
+ * from itself included. Large ranges are cut into chunks scanned by parallel
+ * threads; since each chunk only knows its own newlines, merging is a plain
+ * concatenation in chunk order.
+ */
+void editorIndexRange(const char *text, size_t from, size_t to, size_t size,
+                      struct lineIndex *li) {
+    newlineScanner scan = scanNewlinesImpl();
+    struct scanJob jobs[SCAN_MAX_THREADS];
+    pthread_t tids[SCAN_MAX_THREADS];
+    int started[SCAN_MAX_THREADS] = {0};
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (to - from) / SCAN_CHUNK_MIN;
+    size_t span = to - from;
+    int t;
+
+    if (nthreads > ncpu) nthreads = ncpu;
+    if (nthreads > SCAN_MAX_THREADS) nthreads = SCAN_MAX_THREADS;
+    if (nthreads < 1) nthreads = 1;
+
+    lineIndexReserve(li, 1);
+    li->off[li->n++] = from;
+    if (nthreads == 1) {
+        scan(text, from, to, size, li);
+        return;
+    }
+
+    for (t = 0; t < nthreads; t++) {
+        struct scanJob *job = &jobs[t];
+        job->text = text;
+        job->from = from + span / nthreads * t;
+        job->to = (t == nthreads - 1) ? to : from + span / nthreads * (t + 1);
+        job->size = size;
+        job->scan = scan;
+        memset(&job->li, 0, sizeof(job->li));
+    }
+    for (t = 1; t < nthreads; t++)
+        started[t] = pthread_create(&tids[t], NULL, scanWorker, &jobs[t]) == 0;
+    scanWorker(&jobs[0]);
+
+    for (t = 0; t < nthreads; t++) {
+        if (t > 0 && started[t]) pthread_join(tids[t], NULL);
+        else if (t > 0) scanWorker(&jobs[t]);
+        lineIndexReserve(li, jobs[t].li.n);
+        memcpy(&li->off[li->n], jobs[t].li.off, sizeof(size_t) * jobs[t].li.n);
+        li->n += jobs[t].li.n;
+        li->crlf |= jobs[t].li.crlf;
+        free(jobs[t].li.off);
+    }
+}
+
+/**
+ * Builds the line index of a whole mapped file in one pass.
+ */
+size_t *editorIndexLines(const char *text, size_t size, size_t *nlines, int *crlf) {
+    struct lineIndex li;
+
+    memset(&li, 0, sizeof(li));
+    if (size > 0) editorIndexRange(text, 0, size, size, &li);
+    *nlines = li.n;
+    *crlf = li.crlf;
+    return li.off;
+}
+
+/** ======================== File IO functions ===================================== */
+
+/**
+ * Appends lines [0, nlines) of an index to the end of the store as lazy
+ * blocks. Nothing is copied; each block just points at its slice of the index.
+ */
+void storeAppendLazy(struct textStore *ts, const char *base, const size_t *lineOff,
+                     size_t nlines, size_t end) {
+    size_t i;
+
+    for (i = 0; i < nlines; i += ROW_BLOCK_CAP) {
+        rowBlock *blk = storeAddBlock(ts, ts->nblocks);
+        blk->count = (nlines - i < ROW_BLOCK_CAP) ? nlines - i : ROW_BLOCK_CAP;
+        blk->base = base;
+        blk->lineOff = &lineOff[i];
+        blk->end = (i + blk->count < nlines) ? lineOff[i + blk->count] : end;
+        blk->vlines = blk->count;
+        blk->bytes = blockBytes(blk);
+    }
+    storeReindex(ts);
+}
+
+/** ======================== Background file loading ================================ */
+
+// The first slice is small so the first screen shows up almost at once;
+// later slices double in size to keep the per-slice overhead low.
+#define LOAD_FIRST_SLICE (256 << 10)
+#define LOAD_MAX_SLICE (256 << 20)
+// Cached line offsets are checked and handed over in slices of this many
+// lines, doubling from the first.
+#define LOAD_CACHED_FIRST (16 * ROW_BLOCK_CAP)
+#define LOAD_CACHED_MAX (8 << 20)
+// Buffer size used when reading from a pipe.
+#define LOAD_STREAM_BUF (4 << 20)
+// How often a slow pipe publishes what it has read so far.
+#define LOAD_PUBLISH_MS 20
+
+/**
+ * Hands a run of complete lines over to the UI thread.
+ */
+void loaderPublish(struct fileLoader *ld, const char *base, struct lineIndex *li,
+                   size_t end, size_t bytesDone) {
+    struct loadSlice *slice = malloc(sizeof(struct loadSlice));
+    slice->base = base;
+    slice->lineOff = li->off;
+    slice->nlines = li->n;
+    slice->end = end;
+    slice->next = NULL;
+    if (ld->cachePath) {
+        if (ld->nruns == ld->runCap) {
+            ld->runCap = ld->runCap ? ld->runCap * 2 : 64;
+            ld->runs = realloc(ld->runs, sizeof(struct lineRun) * ld->runCap);
+        }
+        ld->runs[ld->nruns].off = li->off;
+        ld->runs[ld->nruns++].n = li->n;
+    }
+
+    pthread_mutex_lock(&ld->lock);
+    if (ld->tail) ld->tail->next = slice;
+    else ld->head = slice;
+    ld->tail = slice;
+    ld->bytesDone = bytesDone;
+    ld->linesDone += li->n;
+    ld->crlf |= li->crlf;
+    pthread_mutex_unlock(&ld->lock);
+    memset(li, 0, sizeof(*li));
+    editorWake();
+}
+
+void loaderFinish(struct fileLoader *ld) {
+    pthread_mutex_lock(&ld->lock);
+    ld->done = 1;
+    pthread_mutex_unlock(&ld->lock);
+    editorWake();
+}
+
+/**
+ * Hands over the line offsets of the line index cache in slices, as they are
+ * checked: the first line starts at 0, and every other one after the line
+ * before it and within the bytes the cache covers. The offsets stay in the
+ * cache mapping. Returns where the file has to be indexed from: its end when
+ * the cache covers all of it, the start of the last cached line when the
+ * file grew since, as that line may go on, or the start of the line before
+ * the first offset that is out of place.
+ */
+size_t loaderCached(struct fileLoader *ld) {
+    const size_t *off = ld->cached;
+    size_t n = ld->ncached, i = 0, slice = LOAD_CACHED_FIRST;
+    struct lineIndex li;
+
+    if (off[0] != 0) return 0;
+    while (1) {
+        size_t to = (n - 1 - i > slice) ? i + slice : n - 1, j = i + 1;
+
+        //a line is handed over once the start of the line after it is checked
+        while (j <= to && off[j] > off[j - 1] && off[j] < ld->cacheSize) j++;
+        memset(&li, 0, sizeof(li));
+        li.off = (size_t *)&off[i];
+        if (j == n && ld->cacheSize == ld->size) {
+            li.n = n - i;
+            loaderPublish(ld, ld->map, &li, ld->size, ld->size);
+            return ld->size;
+        }
+        if (j - 1 > i) {
+            li.n = j - 1 - i;
+            loaderPublish(ld, ld->map, &li, off[j - 1], off[j - 1]);
+            i = j - 1;
+        }
+        if (j <= to || i == n - 1) return off[i];
+        if (slice < LOAD_CACHED_MAX) slice *= 2;
+    }
+}
+
+/**
+ * Loader thread for mapped files. Lines the cache has are taken from it;
+ * the rest of the file is indexed in slices that end on a line boundary. A
+ * slice with no newline at all is retried twice as wide.
+ */
+void *loaderMapped(void *arg) {
+    struct fileLoader *ld = arg;
+    size_t from = ld->cached ? loaderCached(ld) : 0, slice = LOAD_FIRST_SLICE;
+    int scanned = from < ld->size;
+    struct lineIndex li;
+
+    memset(&li, 0, sizeof(li));
+    madvise((void *)ld->map, ld->size, MADV_SEQUENTIAL);
+    while (from < ld->size) {
+        size_t to = (ld->size - from > slice) ? from + slice : ld->size;
+        size_t next = ld->size;
+
+        editorIndexRange(ld->map, from, to, ld->size, &li);
+        if (to < ld->size) {
+            if (li.n == 1) {
+                //one line longer than the whole slice
+                li.n = 0;
+                slice *= 2;
+                continue;
+            }
+            //the last start begins a line that continues past to
+            next = li.off[--li.n];
+        }
+        loaderPublish(ld, ld->map, &li, next, next);
+        from = next;
+        if (slice < LOAD_MAX_SLICE) slice *= 2;
+    }
+    free(li.off);
+    madvise((void *)ld->map, ld->size, MADV_NORMAL);
+    //a cache that covered the whole file is kept as it is
+    if (ld->cachePath && scanned) lineCacheWrite(ld);
+    loaderFinish(ld);
+    return NULL;
+}
+
+long loaderMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Loader thread for pipes and devices. Text is read into large buffers that
+ * are never moved or freed, since rows borrow from them. When a buffer fills
+ * up, the unfinished line at its end is carried over to the next one.
+ */
+void *loaderStream(void *arg) {
+    struct fileLoader *ld = arg;
+    size_t cap = LOAD_STREAM_BUF, len = 0, total = 0;
+    char *buf = malloc(cap);
+    struct lineIndex li;
+    long lastPublish = loaderMillis();
+
+    memset(&li, 0, sizeof(li));
+    lineIndexReserve(&li, 1);
+    li.off[li.n++] = 0;
+
+    while (1) {
+        ssize_t nread = read(ld->fd, buf + len, cap - len);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) break;
+
+        scanNewlinesImpl()(buf, len, len + nread, (size_t)-1, &li);
+        len += nread;
+        total += nread;
+
+        //everything but the last start is a complete line. Publish them once
+        //there is a block's worth, or when the writer of the pipe pauses.
+        int full = (len == cap);
+        struct pollfd pfd = {ld->fd, POLLIN, 0};
+        if (li.n > 1 && (full || li.n > ROW_BLOCK_CAP ||
+                         loaderMillis() - lastPublish >= LOAD_PUBLISH_MS ||
+                         poll(&pfd, 1, 0) == 0)) {
+            size_t partial = li.off[li.n - 1];
+            li.n--;
+            loaderPublish(ld, buf, &li, partial, total);
+            lineIndexReserve(&li, 1);
+            li.off[li.n++] = partial;
+            lastPublish = loaderMillis();
+        }
+        if (full) {
+            size_t keep = len - li.off[0];
+            size_t newcap = (keep * 2 > LOAD_STREAM_BUF) ? keep * 2 : LOAD_STREAM_BUF;
+            char *next = malloc(newcap);
+            memcpy(next, buf + li.off[0], keep);
+            if (li.off[0] == 0) free(buf); //nothing was published from it
+            buf = next;
+            cap = newcap;
+            len = keep;
+            li.off[0] = 0;
+        }
+    }
+    //a trailing newline does not start another line
+    if (li.n > 0 && li.off[li.n - 1] == len) li.n--;
+    if (li.n > 0) loaderPublish(ld, buf, &li, len, total);
+    else if (li.off[0] == 0) free(buf); //nothing was published from it
+    free(li.off);
+    close(ld->fd);
+    loaderFinish(ld);
+    return NULL;
+}
+
+/**
+ * Returns 1 while the opened file is still being read.
+ */
+int editorLoading() {
+    return editC.loader.running;
+}
+
+/**
+ * Records whether lines of the opened file end in \r\n, once all of them
+ * are known.
+ */
+void editorSetCrlf(int crlf) {
+    int b;
+
+    editC.mapped.crlf = crlf;
+    //lazy blocks were counted as if their lines all ended in a plain \n
+    if (crlf) {
+        for (b = 0; b < editC.text.nblocks; b++)
+            if (!editC.text.blocks[b]->rows) storeMarkBytes(&editC.text, b);
+    }
+}
+
+/**
+ * Called by the UI thread to move the lines the loader has published so far
+ * to the end of the text store. Returns 1 if anything changed.
+ */
+int editorLoaderPoll() {
+    struct fileLoader *ld = &editC.loader;
+    struct loadSlice *slice;
+    int done;
+
+    if (!ld->running) return 0;
+    pthread_mutex_lock(&ld->lock);
+    slice = ld->head;
+    ld->head = ld->tail = NULL;
+    done = ld->done;
+    pthread_mutex_unlock(&ld->lock);
+
+    int changed = slice != NULL || done;
+    while (slice) {
+        struct loadSlice *next = slice->next;
+        storeAppendLazy(&editC.text, slice->base, slice->lineOff, slice->nlines, slice->end);
+        editC.num_rows += slice->nlines;
+        free(slice);
+        slice = next;
+    }
+    if (done) {
+        pthread_join(ld->tid, NULL);
+        ld->running = 0;
+        editorSetCrlf(ld->crlf);
+    }
+    return changed;
+}
+
+/**
+ * Progress of the loader in percent, or -1 when the size is not known.
+ */
+int editorLoadPercent() {
+    struct fileLoader *ld = &editC.loader;
+    int pct;
+
+    if (ld->size == 0) return -1;
+    pthread_mutex_lock(&ld->lock);
+    pct = ld->bytesDone * 100 / ld->size;
+    pthread_mutex_unlock(&ld->lock);
+    return pct;
+}
+
+/**
+ * Starts the loader thread and waits a little for the first screenful of
+ * lines, so the first frame is not drawn empty.
+ */
+void editorStartLoader(void *(*fn)(void *)) {
+    struct fileLoader *ld = &editC.loader;
+    long deadline = loaderMillis() + 100;
+
+    pthread_mutex_init(&ld->lock, NULL);
+    if (pthread_create(&ld->tid, NULL, fn, ld) != 0)
+        handleError("[SMEditor]: Could not start loader thread.");
+    ld->running = 1;
+    while (editorLoading() && editC.num_rows < editC.screen_rows &&
+           loaderMillis() < deadline) {
+        if (!editorLoaderPoll()) usleep(1000);
+    }
+}
+
+/**
+ * Reads the document from a pipe or device in the background.
+ */
+void editorOpenFd(int fd) {
+    editC.loader.fd = fd;
+    editC.loader.size = 0;
+    editorStartLoader(loaderStream);
+}
+
+/**
+ * When the document is piped in (smeditor -), keystrokes have to come from the
+ * terminal instead. Moves the pipe to a new descriptor, reopens the terminal
+ * as standard input and returns the descriptor of the pipe.
+ */
+int editorStdinToTty() {
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+
+    if (fd == -1 || tty == -1) handleError("[SMEditor]: Could not open /dev/tty.");
+    dup2(tty, STDIN_FILENO);
+    close(tty);
+    return fd;
+}
+
+/**
+ * Opens a file for editing. Regular files are mapped read-only and only a
+ * line-offset index is built; rows are created lazily from the mapping and
+ * get their own copy of the text once edited, so memory grows with the
+ * edits made rather than with the file size.
+ * The index is built by a loader thread while the UI already shows the lines
+ * found so far; see editorLoaderPoll().
+ */
+void editorOpen(char *filename) {
+    free(editC.filename);
+    //Allocate memory and make a copy of the given filename using string function strdup
+    editC.filename = strdup(filename);
+    editorSelectSyntax();
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) handleError("[SMEditor]: Could not open file.");
+
+    struct stat st;
+    char *map = MAP_FAILED;
+
+    if (fstat(fd, &st) == -1) handleError("[SMEditor]: Could not open file.");
+    if (S_ISREG(st.st_mode) && st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    if (S_ISREG(st.st_mode))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        //pipes and devices are read into memory instead
+        editorOpenFd(fd);
+        return;
+    }
+
+    editC.mapped.fd = fd;
+    editC.mapped.map = map;
+    editC.mapped.size = st.st_size;
+
+    editC.loader.map = map;
+    editC.loader.size = st.st_size;
+    editC.loader.st = st;
+    //an index of the file cached by an earlier run spares scanning all or
+    //most of it
+    lineCacheLoad(&editC.loader, filename);
+    editorStartLoader(loaderMapped);
+}
+/** ======================== Saving ================================================ */
+
+// How often the status bar shows the progress of a running save.
+#define SAVE_PROGRESS_MS 100
+// A save writes at most this many iovecs, or this many bytes, per writev().
+#define SAVE_IOV 1024
+#define SAVE_BATCH (1 << 20)
+// Ranges of the opened file are copied in pieces this big, to report progress.
+#define SAVE_COPY_CHUNK (64 << 20)
+
+// State of a save in progress. Rows are queued as iovecs that point at their
+// text, so nothing is copied. Runs of untouched lines of the opened file are
+// queued as a range of that file instead, which the kernel copies with
+// copy_file_range() without the data ever passing through the editor.
+struct saveWriter {
+    int fd;
+    struct iovec iov[SAVE_IOV];
+    int niov;
+    size_t queued; //bytes in iov
+    off_t copyFrom; //queued range of the opened file
+    size_t copyLen;
+    off_t written;
+    int error; //errno of the first failure, 0 if none
+    struct saveJob *job; //where progress is reported, or NULL
+};
+
+void saveProgress(struct saveWriter *w) {
+    if (w->job == NULL) return;
+    pthread_mutex_lock(&w->job->lock);
+    w->job->written = w->written;
+    pthread_mutex_unlock(&w->job->lock);
+}
+
+/**
+ * Writes the queued iovecs, picking up after short writes.
+ */
+void saveFlushText(struct saveWriter *w) {
+    struct iovec *iov = w->iov;
+    int n = w->niov;
+
+    while (n > 0 && !w->error) {
+        ssize_t done = writev(w->fd, iov, n);
+        if (done == -1) {
+            if (errno != EINTR) w->error = errno;
+            continue;
+        }
+        w->written += done;
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    w->niov = 0;
+    w->queued = 0;
+    saveProgress(w);
+}
+
+/**
+ * Copies the queued range of the opened file. Falls back to writing it from
+ * the mapping where the file system cannot copy between the two files.
+ */
+void saveFlushCopy(struct saveWriter *w) {
+    off_t from = w->copyFrom;
+    size_t left = w->copyLen;
+
+    while (left > 0 && !w->error) {
+        size_t chunk = (left < SAVE_COPY_CHUNK) ? left : SAVE_COPY_CHUNK;
+        ssize_t done = copy_file_range(editC.mapped.fd, &from, w->fd, NULL, chunk, 0);
+        if (done == -1 && errno == EINTR) continue;
+        if (done <= 0) {
+            if (done == -1 && errno != EXDEV && errno != ENOSYS &&
+                errno != EINVAL && errno != EOPNOTSUPP) {
+                w->error = errno;
+                break;
+            }
+            done = write(w->fd, editC.mapped.map + from, chunk);
+            if (done == -1) {
+                if (errno != EINTR) w->error = errno;
+                continue;
+            }
+            from += done;
+        }
+        left -= done;
+        w->written += done;
+        saveProgress(w);
+    }
+    w->copyLen = 0;
+}
+
+void saveFlush(struct saveWriter *w) {
+    if (w->niov) saveFlushText(w);
+    if (w->copyLen) saveFlushCopy(w);
+}
+
+/**
+ * Queues len bytes at p. Text that directly follows the previous iovec is
+ * merged into it.
+ */
+void saveText(struct saveWriter *w, const char *p, size_t len) {
+    struct iovec *last = w->niov ? &w->iov[w->niov - 1] : NULL;
+
+    if (len == 0) return;
+    if (w->copyLen) saveFlushCopy(w);
+    if (last && (char *)last->iov_base + last->iov_len == p) {
+        last->iov_len += len;
+    } else {
+        if (w->niov == SAVE_IOV) saveFlushText(w);
+        w->iov[w->niov].iov_base = (void *)p;
+        w->iov[w->niov].iov_len = len;
+        w->niov++;
+    }
+    w->queued += len;
+    if (w->queued >= SAVE_BATCH) saveFlushText(w);
+}
+
+/**
+ * Queues len bytes at p, which may lie in the mapping of the opened file.
+ */
+void saveRange(struct saveWriter *w, const char *p, size_t len) {
+    const char *map = editC.mapped.map;
+
+    if (len == 0) return;
+    if (map == NULL || p < map || p + len > map + editC.mapped.size) {
+        saveText(w, p, len);
+        return;
+    }
+    off_t off = p - map;
+    if (w->copyLen && w->copyFrom + (off_t)w->copyLen == off) {
+        w->copyLen += len;
+        return;
+    }
+    saveFlush(w);
+    w->copyFrom = off;
+    w->copyLen = len;
+}
+
+/**
+ * Queues a line and the newline after it. When the line is still in the
+ * opened file followed by a plain \n, that newline is used, so runs of
+ * untouched lines turn into a single range.
+ */
+void saveLine(struct saveWriter *w, const char *line, long len) {
+    const char *map = editC.mapped.map;
+
+    if (map && line >= map && line + len < map + editC.mapped.size && line[len] == '\n') {
+        saveRange(w, line, len + 1);
+        return;
+    }
+    saveText(w, line, len);
+    saveText(w, "\n", 1);
+}
+
+/**
+ * Number of bytes editorWriteRows() will write for a snapshot.
+ */
+off_t snapshotSize(struct textSnapshot *snap) {
+    off_t total = 0;
+    int b, j;
+    long len;
+
+    for (b = 0; b < snap->nblocks; b++) {
+        rowBlock *blk = snap->blocks[b];
+        if (!blk->rows && !editC.mapped.crlf) {
+            total += blk->end - blk->lineOff[0] + (blk->base[blk->end - 1] != '\n');
+            continue;
+        }
+        for (j = 0; j < blk->count; j++) {
+            blockLine(blk, j, &len);
+            total += len + 1;
+        }
+    }
+    return total;
+}
+
+/**
+ * Streams a snapshot of the document to fd, one line per row. Lazy blocks
+ * are written as the slice of text they describe when no line in it needs
+ * its line terminator rewritten. Returns the number of bytes written, or -1
+ * with errno set.
+ */
+off_t editorWriteRows(int fd, struct textSnapshot *snap, struct saveJob *job) {
+    struct saveWriter w;
+    int b, j;
+    long len;
+
+    w.fd = fd;
+    w.niov = 0;
+    w.queued = 0;
+    w.copyLen = 0;
+    w.written = 0;
+    w.error = 0;
+    w.job = job;
+    for (b = 0; b < snap->nblocks && !w.error; b++) {
+        rowBlock *blk = snap->blocks[b];
+        j = 0;
+        if (!blk->rows && !editC.mapped.crlf) {
+            //every line but maybe the last one of the file ends in a plain \n
+            size_t to = (blk->base[blk->end - 1] == '\n') ? blk->end : blk->lineOff[blk->count - 1];
+            saveRange(&w, blk->base + blk->lineOff[0], to - blk->lineOff[0]);
+            j = (to == blk->end) ? blk->count : blk->count - 1;
+        }
+        for (; j < blk->count; j++) {
+            const char *line = blockLine(blk, j, &len);
+            saveLine(&w, line, len);
+        }
+    }
+    saveFlush(&w);
+    if (w.error) {
+        errno = w.error;
+        return -1;
+    }
+    return w.written;
+}
+
+/**
+ * Writer thread of a save. Only reads the snapshot, never the live document,
+ * and only touches the file system: the UI thread finishes the save in
+ * editorSavePoll().
+ */
+void *saveThread(void *arg) {
+    struct saveJob *job = arg;
+    off_t total = snapshotSize(&job->snap);
+
+    pthread_mutex_lock(&job->lock);
+    job->total = total;
+    pthread_mutex_unlock(&job->lock);
+
+    off_t len = editorWriteRows(job->fd, &job->snap, job);
+    if (len != -1 && fsync(job->fd) == -1) len = -1;
+    if (close(job->fd) == -1) len = -1;
+    if (len != -1 && rename(job->tmp, job->target) == -1) len = -1;
+    int error = (len == -1) ? errno : 0;
+    if (len == -1) {
+        unlink(job->tmp);
+    } else {
+        //make the rename itself durable
+        char *dir = strdup(job->target);
+        char *slash = strrchr(dir, '/');
+        if (slash) *slash = '\0';
+        int dfd = open(slash ? (slash == dir ? "/" : dir) : ".", O_RDONLY);
+        if (dfd != -1) {
+            fsync(dfd);
+            close(dfd);
+        }
+        free(dir);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->written = len;
+    job->error = error;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    editorWake();
+    return NULL;
+}
+
+/**
+ * Returns 1 while a save is running.
+ */
+int editorSaving() {
+    return editC.save.running;
+}
+
+/**
+ * Reports the outcome of a save whose writer has finished. Edits made while
+ * the save ran keep the file marked modified.
+ */
+void saveFinish(struct saveJob *job) {
+    snapshotRelease(&job->snap);
+    if (job->error == 0) {
+        editC.dirtyFlag -= job->dirtyAt;
+        editorSetStatusMsg("%lld bytes written to disk.", (long long)job->written);
+    } else {
+        editorSetStatusMsg("Failed to save file to disk: %s", strerror(job->error));
+    }
+    free(job->tmp);
+    free(job->target);
+}
+
+/**
+ * Called by the UI thread to finish a save once the writer is done. Returns
+ * 1 if it did.
+ */
+int editorSavePoll() {
+    struct saveJob *job = &editC.save;
+    int done;
+
+    if (!job->running) return 0;
+    pthread_mutex_lock(&job->lock);
+    done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    if (!done) return 0;
+
+    pthread_join(job->tid, NULL);
+    job->running = 0;
+    saveFinish(job);
+    return 1;
+}
+
+/**
+ * Blocks until a running save is finished, e.g. before quitting.
+ */
+void editorSaveWait() {
+    if (!editC.save.running) return;
+    pthread_join(editC.save.tid, NULL);
+    editC.save.running = 0;
+    saveFinish(&editC.save);
+}
+
+/**
+ * Progress of the running save in percent, and its throughput in MB/s.
+ */
+int editorSavePercent(double *mbps) {
+    struct saveJob *job = &editC.save;
+    off_t written, total;
+    long ms = loaderMillis() - job->started;
+
+    pthread_mutex_lock(&job->lock);
+    written = job->written;
+    total = job->total;
+    pthread_mutex_unlock(&job->lock);
+    *mbps = (ms > 0) ? written / 1e3 / ms : 0;
+    return total ? written * 100 / total : 0;
+}
+
+/**
+ * Saves the document without ever touching the file on disk until the new
+ * contents are safely in place. The rows are streamed to a temporary file
+ * next to it, which is flushed to disk and then renamed over the original,
+ * so a failed or partial write leaves the original file as it was. Memory
+ * use does not depend on the size of the document.
+ * The writing happens in a background thread, from a snapshot of the
+ * document taken when Ctrl-S was pressed, so editing goes on meanwhile.
+ * Rows may still borrow their text from the mapping of the opened file; the
+ * mapping keeps the old contents alive after the rename.
+ */
+void editorSave() {
+    struct saveJob *job = &editC.save;
+
+    if (editorLoading()) {
+        editorSetStatusMsg("Still loading the file, try again when done.");
+        return;
+    }
+    if (editorSaving()) {
+        editorSetStatusMsg("Already saving, try again when done.");
+        return;
+    }
+    if (editC.filename == NULL) {
+        editC.filename = editorPrompt("Save file as: %s", NULL);
+        if (editC.filename == NULL) {
+            editorSetStatusMsg("Save aborted.");
+            return;
+        }
+        editorSelectSyntax();
+    }
+
+    //replace the file a symlink points to, not the link
+    job->target = realpath(editC.filename, NULL);
+    if (job->target == NULL) job->target = strdup(editC.filename);
+
+    size_t tmplen = strlen(job->target) + 16;
+    job->tmp = malloc(tmplen);
+    snprintf(job->tmp, tmplen, "%s.smtmp-XXXXXX", job->target);
+    job->fd = mkstemp(job->tmp);
+    if (job->fd == -1) {
+        editorSetStatusMsg("Failed to save file to disk: %s", strerror(errno));
+        free(job->tmp);
+        free(job->target);
+        return;
+    }
+    struct stat st;
+    fchmod(job->fd, stat(job->target, &st) == 0 ? (st.st_mode & 07777) : 0644);
+
+    storeSnapshot(&editC.text, &job->snap);
+    job->dirtyAt = editC.dirtyFlag;
+    job->started = loaderMillis();
+    job->total = 0;
+    job->written = 0;
+    job->error = 0;
+    job->done = 0;
+    pthread_mutex_init(&job->lock, NULL);
+    if (pthread_create(&job->tid, NULL, saveThread, job) == 0) {
+        job->running = 1;
+        return;
+    }
+    //no thread to spare: save right here instead
+    saveThread(job);
+    saveFinish(job);
+}
+
+/** ======================== Line index cache ============================*/
+/*
+ * Files of LINE_CACHE_MIN bytes and up leave the offsets of their lines in a
+ * cache directory once loaded, so opening them again maps that index instead
+ * of scanning the file. A cache file is a lineCacheHeader, the absolute path
+ * of the file, and its line offsets as the text store keeps them; lazy blocks
+ * point straight into its mapping. The offsets are checked on the loader
+ * thread as it hands them over, so opening does not wait on all of them. It is used when the file has the same
+ * device, inode, size and mtime, and the same bytes at LINE_CACHE_SAMPLES
+ * places spread over it. A file that only grew, such as a log, keeps the lines
+ * of the cache but the last one, and only the rest is scanned; the cache is
+ * then written again. The directory is kept within SMEDITOR_CACHE_MB
+ * megabytes by removing the cache files used least recently.
+ */
+#define LINE_CACHE_MIN (64 << 20)
+#define LINE_CACHE_MAGIC "SMLINES1"
+#define LINE_CACHE_SAMPLES 32
+#define LINE_CACHE_SAMPLE_BYTES 4096
+#define LINE_CACHE_TEMP_SECS 3600 //age a temporary file is taken as left by a crash
+
+// A cache file found when trimming the cache directory.
+struct lineCacheFile {
+    char *path;
+    off_t size;
+    time_t used; //mtime, touched each time the cache is used
+};
+
+struct lineCacheHeader {
+    char magic[8];
+    uint64_t size; //bytes of the file the offsets cover
+    uint64_t dev, ino;
+    int64_t mtime, mtimeNsec;
+    uint64_t sample; //lineCacheSample() of those bytes
+    uint64_t nlines;
+    uint32_t crlf;
+    uint32_t pathLen; //the path follows, padded to 8 bytes, then the offsets
+};
+
+/**
+ * FNV-1a hash of len bytes, continuing from h.
+ */
+uint64_t lineCacheHash(uint64_t h, const char *s, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Checksum of the first size bytes of the file: LINE_CACHE_SAMPLES pieces
+ * spread evenly from its start to its end, so the cost does not grow with
+ * the file.
+ */
+uint64_t lineCacheSample(const char *map, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t len = size < LINE_CACHE_SAMPLE_BYTES ? size : LINE_CACHE_SAMPLE_BYTES;
+    int i;
+
+    for (i = 0; i < LINE_CACHE_SAMPLES; i++)
+        h = lineCacheHash(h, map + (size - len) / (LINE_CACHE_SAMPLES - 1) * i, len);
+    return h;
+}
+
+/**
+ * Returns the name of the cache file for the file at key, an absolute path,
+ * creating the cache directory if needed: $XDG_CACHE_HOME/smeditor, or
+ * ~/.cache/smeditor. NULL if there is nowhere to put it.
+ */
+char *lineCachePath(const char *key) {
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char dir[PATH_MAX];
+
+    if (xdg && *xdg) {
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    mkdir(dir, 0700);
+    strncat(dir, "/smeditor", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) return NULL;
+
+    size_t len = strlen(dir) + 32;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%016llx.lines", dir,
+             (unsigned long long)lineCacheHash(14695981039346656037ULL, key, strlen(key)));
+    return path;
+}
+
+/**
+ * Looks for a cached index of the file being opened. Only its header is
+ * checked here, so this takes the same time however big the file; the loader
+ * checks the offsets as it hands them over, see loaderCached(), and indexes
+ * whatever part of the file they do not cover.
+ */
+void lineCacheLoad(struct fileLoader *ld, const char *filename) {
+    struct stat cst;
+
+    ld->cached = NULL;
+    if (ld->size < LINE_CACHE_MIN || sizeof(size_t) != sizeof(uint64_t)) return;
+    ld->cacheKey = realpath(filename, NULL);
+    if (ld->cacheKey == NULL) return;
+    ld->cachePath = lineCachePath(ld->cacheKey);
+    if (ld->cachePath == NULL) return;
+
+    int fd = open(ld->cachePath, O_RDONLY);
+    if (fd == -1) return;
+    if (fstat(fd, &cst) == -1 || (size_t)cst.st_size < sizeof(struct lineCacheHeader)) {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const struct lineCacheHeader *hdr = (const struct lineCacheHeader *)map;
+    size_t start = sizeof(*hdr) + ((hdr->pathLen + 7) & ~(size_t)7);
+    int same = hdr->size == ld->size && hdr->mtime == ld->st.st_mtim.tv_sec &&
+               hdr->mtimeNsec == ld->st.st_mtim.tv_nsec;
+    //sizes are checked against the file before they are used, so a corrupt
+    //header cannot make the checks below read past the mapping
+    if (memcmp(hdr->magic, LINE_CACHE_MAGIC, 8) != 0 || hdr->nlines == 0 ||
+        hdr->pathLen != strlen(ld->cacheKey) || start > (size_t)cst.st_size ||
+        hdr->nlines > ((size_t)cst.st_size - start) / sizeof(size_t) ||
+        (size_t)cst.st_size != start + hdr->nlines * sizeof(size_t) ||
+        memcmp(map + sizeof(*hdr), ld->cacheKey, hdr->pathLen) != 0 ||
+        hdr->dev != (uint64_t)ld->st.st_dev || hdr->ino != (uint64_t)ld->st.st_ino ||
+        !(same || hdr->size < ld->size) || hdr->sample != lineCacheSample(ld->map, hdr->size)) {
+        munmap(map, cst.st_size);
+        return;
+    }
+    //the cache files least recently used are the first removed
+    utimensat(AT_FDCWD, ld->cachePath, NULL, 0);
+
+    //the mapping stays for as long as the blocks point into it
+    ld->cached = (const size_t *)(map + start);
+    ld->ncached = hdr->nlines;
+    ld->cacheSize = hdr->size;
+    ld->crlf = hdr->crlf;
+}
+
+/**
+ * Writes the offsets of every line of the loaded file to its cache file.
+ * Runs on the loader thread: the offsets are written from where the text
+ * store has them, without a copy, and the file replaces the old one only
+ * once complete.
+ */
+void lineCacheWrite(struct fileLoader *ld) {
+    static const char zeros[8];
+    struct lineCacheHeader hdr;
+    struct saveWriter w;
+    int k;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LINE_CACHE_MAGIC, 8);
+    hdr.size = ld->size;
+    hdr.dev = ld->st.st_dev;
+    hdr.ino = ld->st.st_ino;
+    hdr.mtime = ld->st.st_mtim.tv_sec;
+    hdr.mtimeNsec = ld->st.st_mtim.tv_nsec;
+    hdr.sample = lineCacheSample(ld->map, ld->size);
+    for (k = 0; k < ld->nruns; k++) hdr.nlines += ld->runs[k].n;
+    hdr.crlf = ld->crlf;
+    hdr.pathLen = strlen(ld->cacheKey);
+
+    size_t tmplen = strlen(ld->cachePath) + 8;
+    char *tmp = malloc(tmplen);
+    snprintf(tmp, tmplen, "%s.XXXXXX", ld->cachePath);
+    memset(&w, 0, sizeof(w));
+    w.fd = mkstemp(tmp);
+    if (w.fd == -1) {
+        free(tmp);
+        return;
+    }
+    saveText(&w, (const char *)&hdr, sizeof(hdr));
+    saveText(&w, ld->cacheKey, hdr.pathLen);
+    saveText(&w, zeros, (8 - hdr.pathLen % 8) % 8);
+    for (k = 0; k < ld->nruns; k++)
+        saveText(&w, (const char *)ld->runs[k].off, ld->runs[k].n * sizeof(size_t));
+    saveFlush(&w);
+    //on disk before the rename, so a crash cannot leave a short file in place
+    if (!w.error && fsync(w.fd) == -1) w.error = errno;
+    if (close(w.fd) == -1 && !w.error) w.error = errno;
+    if (w.error || rename(tmp, ld->cachePath) == -1) unlink(tmp);
+    free(tmp);
+    lineCacheTrim(ld->cachePath);
+}
+
+int lineCacheCompareUsed(const void *a, const void *b) {
+    time_t ua = ((const struct lineCacheFile *)a)->used;
+    time_t ub = ((const struct lineCacheFile *)b)->used;
+    return (ua > ub) - (ua < ub);
+}
+
+/**
+ * Keeps the directory of the cache file at keep within SMEDITOR_CACHE_MB
+ * megabytes, removing the cache files used least recently but keep, and
+ * removes the temporary files of writes that never finished.
+ */
+void lineCacheTrim(const char *keep) {
+    const char *mb = getenv("SMEDITOR_CACHE_MB");
+    off_t budget = (off_t)(mb && atoi(mb) > 0 ? atoi(mb) : SMEDITOR_CACHE_MB) << 20;
+    const char *slash = strrchr(keep, '/');
+    struct lineCacheFile *files = NULL;
+    int nfiles = 0, cap = 0, k;
+    off_t total = 0;
+    struct dirent *de;
+    struct stat st;
+    char path[PATH_MAX];
+
+    if (slash == NULL) return;
+    int dirlen = slash - keep;
+    snprintf(path, sizeof(path), "%.*s", dirlen, keep);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return;
+    while ((de = readdir(dir)) != NULL) {
+        //cache files are <hash>.lines, and <hash>.lines.XXXXXX while written
+        const char *ext = strstr(de->d_name, ".lines");
+        if (ext == NULL || (ext[6] != '\0' && ext[6] != '.')) continue;
+        snprintf(path, sizeof(path), "%.*s/%s", dirlen, keep, de->d_name);
+        if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode)) continue;
+        if (ext[6] == '.') {
+            if (time(NULL) - st.st_mtime > LINE_CACHE_TEMP_SECS) unlink(path);
+            continue;
+        }
+        total += st.st_size;
+        if (strcmp(path, keep) == 0) continue;
+        if (nfiles == cap) {
+            cap = cap ? cap * 2 : 16;
+            files = realloc(files, sizeof(struct lineCacheFile) * cap);
+        }
+        files[nfiles].path = strdup(path);
+        files[nfiles].size = st.st_size;
+        files[nfiles].used = st.st_mtime;
+        nfiles++;
+    }
+    closedir(dir);
+
+    if (nfiles) qsort(files, nfiles, sizeof(struct lineCacheFile), lineCacheCompareUsed);
+    for (k = 0; k < nfiles; k++) {
+        if (total > budget && unlink(files[k].path) == 0) total -= files[k].size;
+        free(files[k].path);
+    }
+    free(files);
+}
+
+/** ======================== Regex Functions ============================*/
+/*
+ * Regular expressions for search. A pattern is parsed into a small syntax
+ * tree, then compiled into a Thompson NFA that reads the pattern backwards.
+ * Rows are read from their end with a DFA built lazily from that NFA. After
+ * reading back to column s, the DFA is in a matching state exactly when a
+ * match starts at s. So one pass over a row finds every match start in linear
+ * time, with no backtracking whatever the pattern.
+ * Replacing also needs where a match ends: a second NFA reads the pattern
+ * forwards, anchored at the start found.
+ *
+ * Syntax: literals, . [abc] [^a-z] \d \w \s \D \W \S and other escaped bytes,
+ * ^ and $ for the start and end of the row, a|b, (...), * + ? {m} {m,} {m,n}.
+ */
+
+#define RX_MAX_NODES 4096 //syntax tree nodes in a pattern
+#define RX_MAX_STATES 16384 //NFA states, once {m,n} are expanded
+#define RX_MAX_REPEAT 255
+#define RX_MAX_DEPTH 256 //nested groups
+#define RX_MAX_LITERAL 64
+#define RX_DFA_MAX_STATES 1024 //DFA states cached before the cache is flushed
+#define RX_DFA_TABLE (2 * RX_DFA_MAX_STATES) //hash slots, a power of two
+
+#define RX_SET(set, c) ((set)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define RX_HAS(set, c) ((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+enum rxNodeType { RX_EMPTY, RX_CHARS, RX_CAT, RX_ALT, RX_REPEAT, RX_BOL, RX_EOL };
+enum rxStateType { RXS_MATCH, RXS_CHARS, RXS_SPLIT, RXS_BOL, RXS_EOL };
+
+typedef struct rxNode {
+    int type;
+    int a, b; //children: both for CAT and ALT, a for REPEAT
+    int min, max; //bounds of REPEAT, max -1 if there is none
+    int set; //CHARS: index of its byte set
+} rxNode;
+
+typedef struct rxState {
+    int type;
+    int out, out1; //next states, out1 only for SPLIT
+    int set; //CHARS: index of its byte set
+} rxState;
+
+struct regex {
+    rxNode *nodes;
+    int nnodes, nodeCap;
+    unsigned char (*sets)[32]; //byte sets as bitmaps
+    int nsets, setCap;
+    rxState *states; //both NFAs; state 0 is the match
+    int nstates, stateCap;
+    int start; //of the NFA reading backwards
+    int fstart; //of the NFA reading forwards
+    char lit[RX_MAX_LITERAL]; //a literal every match contains
+    int litlen;
+};
+
+// A DFA state: the NFA states the backwards reading may be in.
+struct rxDState {
+    struct rxDState *next[256]; //state after reading one more byte back, or NULL
+    int *set; //sorted: CHARS, MATCH and assertions not satisfied yet
+    int n;
+    unsigned char match; //a match starts (ends, reading forwards) here
+    unsigned char matchAtEdge; //the same, if this is column 0 (the row end)
+};
+
+// The lazy DFA of a regex. It is built while searching, so every thread
+// searching needs its own; the regex itself is only read. States link to
+// each other directly, so reading a byte is a single load.
+struct regexDfa {
+    struct regex *re;
+    int forward; //reads forwards from a given start instead of backwards
+    struct rxDState *states[RX_DFA_MAX_STATES];
+    int nstates;
+    struct rxDState *table[RX_DFA_TABLE]; //DFA states by set, NULL if free
+    //first state: backwards at the end of a row in [0]; forwards from
+    //column 0 in [1] and from further on in [0]. NULL until built.
+    struct rxDState *initial[2];
+    int matchEmpty; //an empty row matches, -1 until known
+    int *stack, *seeds, *set, *bol, *mark; //scratch for rxClosure() and rxStep()
+    int stamp;
+};
+
+struct rxParser {
+    struct regex *re;
+    const char *p;
+    const char *err;
+    int depth;
+};
+
+int rxAddNode(struct rxParser *ps, int type, int a, int b) {
+    struct regex *re = ps->re;
+
+    if (re->nnodes == RX_MAX_NODES) {
+        ps->err = "pattern too long";
+        return -1;
+    }
+    if (re->nnodes == re->nodeCap) {
+        re->nodeCap = re->nodeCap ? re->nodeCap * 2 : 32;
+        re->nodes = realloc(re->nodes, sizeof(rxNode) * re->nodeCap);
+    }
+    rxNode *n = &re->nodes[re->nnodes];
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    n->min = n->max = 0;
+    n->set = -1;
+    if (type == RX_CHARS) {
+        if (re->nsets == re->setCap) {
+            re->setCap = re->setCap ? re->setCap * 2 : 32;
+            re->sets = realloc(re->sets, 32 * re->setCap);
+        }
+        memset(re->sets[re->nsets], 0, 32);
+        n->set = re->nsets++;
+    }
+    return re->nnodes++;
+}
+
+/**
+ * The byte an escape like \t stands for; other escaped bytes stand for
+ * themselves.
+ */
+unsigned char rxEscapeByte(unsigned char c) {
+    switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    }
+    return c;
+}
+
+/**
+ * Adds the bytes matched by an escape to set: \d \w \s, their complements
+ * \D \W \S, or the single byte of any other escape.
+ */
+void rxEscapeSet(unsigned char *set, unsigned char c) {
+    unsigned char cls[32];
+    int i;
+
+    memset(cls, 0, sizeof(cls));
+    switch (c) {
+    case 'd': case 'D':
+        for (i = '0'; i <= '9'; i++) RX_SET(cls, i);
+        break;
+    case 'w': case 'W':
+        for (i = 0; i < 256; i++) if (isalnum(i) || i == '_') RX_SET(cls, i);
+        break;
+    case 's': case 'S':
+        for (i = 0; i < 256; i++) if (isspace(i)) RX_SET(cls, i);
+        break;
+    default:
+        RX_SET(set, rxEscapeByte(c));
+        return;
+    }
+    for (i = 0; i < 32; i++) set[i] |= isupper(c) ? ~cls[i] : cls[i];
+}
+
+/**
+ * Parses a bracket expression, the [ already read.
+ */
+int rxParseClass(struct rxParser *ps) {
+    int n = rxAddNode(ps, RX_CHARS, -1, -1), neg = 0, i;
+    unsigned char set[32];
+
+    if (n < 0) return -1;
+    memset(set, 0, sizeof(set));
+    if (*ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    //a ] right after the [ or [^ is a literal
+    if (*ps->p == ']') {
+        RX_SET(set, ']');
+        ps->p++;
+    }
+    while (*ps->p && *ps->p != ']') {
+        unsigned char lo = *ps->p++;
+        if (lo == '\\') {
+            if (!*ps->p) break;
+            lo = *ps->p++;
+            if (strchr("dwsDWS", lo)) {
+                rxEscapeSet(set, lo);
+                continue;
+            }
+            lo = rxEscapeByte(lo);
+        }
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            unsigned char hi = ps->p[1];
+            ps->p += 2;
+            if (hi < lo) {
+                ps->err = "bad range";
+                return -1;
+            }
+            for (i = lo; i <= hi; i++) RX_SET(set, i);
+        } else {
+            RX_SET(set, lo);
+        }
+    }
+    if (*ps->p != ']') {
+        ps->err = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    for (i = 0; i < 32; i++) ps->re->sets[ps->re->nodes[n].set][i] = neg ? ~set[i] : set[i];
+    return n;
+}
+
+int rxParseAlt(struct rxParser *ps);
+
+int rxParseAtom(struct rxParser *ps) {
+    char c = *ps->p++;
+    int n;
+
+    switch (c) {
+    case '(':
+        if (++ps->depth > RX_MAX_DEPTH) {
+            ps->err = "too deeply nested";
+            return -1;
+        }
+        n = rxParseAlt(ps);
+        ps->depth--;
+        if (n < 0) return -1;
+        if (*ps->p != ')') {
+            ps->err = "missing )";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    case '[':
+        return rxParseClass(ps);
+    case '^':
+        return rxAddNode(ps, RX_BOL, -1, -1);
+    case '$':
+        return rxAddNode(ps, RX_EOL, -1, -1);
+    case '*': case '+': case '?':
+        ps->err = "nothing to repeat";
+        return -1;
+    }
+    if (c == '\\' && *ps->p == '\0') {
+        ps->err = "trailing \\";
+        return -1;
+    }
+    n = rxAddNode(ps, RX_CHARS, -1, -1);
+    if (n < 0) return -1;
+    unsigned char *set = ps->re->sets[ps->re->nodes[n].set];
+    if (c == '.') memset(set, 0xff, 32);
+    else if (c == '\\') rxEscapeSet(set, *ps->p++);
+    else RX_SET(set, c);
+    return n;
+}
+
+int rxParseRepeat(struct rxParser *ps) {
+    int n = rxParseAtom(ps);
+
+    while (n >= 0) {
+        int min, max;
+        char *end;
+        if (*ps->p == '*') {
+            min = 0;
+            max = -1;
+        } else if (*ps->p == '+') {
+            min = 1;
+            max = -1;
+        } else if (*ps->p == '?') {
+            min = 0;
+            max = 1;
+        } else if (*ps->p == '{' && isdigit((unsigned char)ps->p[1])) {
+            min = max = strtol(ps->p + 1, &end, 10);
+            if (*end == ',') {
+                end++;
+                max = isdigit((unsigned char)*end) ? strtol(end, &end, 10) : -1;
+            }
+            if (*end != '}' || min > RX_MAX_REPEAT || max > RX_MAX_REPEAT ||
+                (max >= 0 && max < min)) {
+                ps->err = "bad {m,n}";
+                return -1;
+            }
+            ps->p = end;
+        } else {
+            break;
+        }
+        ps->p++;
+        n = rxAddNode(ps, RX_REPEAT, n, -1);
+        if (n < 0) return -1;
+        ps->re->nodes[n].min = min;
+        ps->re->nodes[n].max = max;
+    }
+    return n;
+}
+
+int rxParseCat(struct rxParser *ps) {
+    int n = -1, m;
+
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        if ((m = rxParseRepeat(ps)) < 0) return -1;
+        n = (n < 0) ? m : rxAddNode(ps, RX_CAT, n, m);
+        if (n < 0) return -1;
+    }
+    return (n < 0) ? rxAddNode(ps, RX_EMPTY, -1, -1) : n;
+}
+
+int rxParseAlt(struct rxParser *ps) {
+    int n = rxParseCat(ps), m;
+
+    while (n >= 0 && *ps->p == '|') {
+        ps->p++;
+        if ((m = rxParseCat(ps)) < 0) return -1;
+        n = rxAddNode(ps, RX_ALT, n, m);
+    }
+    return n;
+}
+
+/**
+ * Walks the concatenations of node n in order, looking for the longest run of
+ * single bytes every match contains. run is the run being extended.
+ */
+void rxFindLiteral(struct regex *re, int n, char *run, int *runlen) {
+    rxNode *node = &re->nodes[n];
+    int i, c = -1, count = 0;
+
+    switch (node->type) {
+    case RX_CAT:
+        rxFindLiteral(re, node->a, run, runlen);
+        rxFindLiteral(re, node->b, run, runlen);
+        return;
+    case RX_EMPTY: case RX_BOL: case RX_EOL:
+        return; //match no byte, so the run goes on
+    case RX_CHARS:
+        for (i = 0; i < 256; i++) {
+            if (RX_HAS(re->sets[node->set], i)) {
+                c = i;
+                count++;
+            }
+        }
+        if (count == 1 && *runlen < RX_MAX_LITERAL) {
+            run[(*runlen)++] = c;
+            if (*runlen > re->litlen) {
+                memcpy(re->lit, run, *runlen);
+                re->litlen = *runlen;
+            }
+            return;
+        }
+        break;
+    case RX_REPEAT:
+        //what one repetition needs, the whole needs if there is at least one
+        if (node->min > 0) {
+            char inner[RX_MAX_LITERAL];
+            int innerlen = 0;
+            rxFindLiteral(re, node->a, inner, &innerlen);
+        }
+        break;
+    }
+    *runlen = 0;
+}
+
+int rxAddState(struct regex *re, int type, int out, int out1, int set) {
+    if (re->nstates == RX_MAX_STATES) return -1;
+    if (re->nstates == re->stateCap) {
+        re->stateCap = re->stateCap ? re->stateCap * 2 : 64;
+        re->states = realloc(re->states, sizeof(rxState) * re->stateCap);
+    }
+    rxState *st = &re->states[re->nstates];
+    st->type = type;
+    st->out = out;
+    st->out1 = out1;
+    st->set = set;
+    return re->nstates++;
+}
+
+/**
+ * Compiles node n into NFA states that read its text, backwards unless
+ * forward is set, and then go on to state next. Returns the first of them, or
+ * -1 if the NFA grows too big.
+ */
+int rxEmit(struct regex *re, int n, int next, int forward) {
+    rxNode *node = &re->nodes[n];
+    int i, cur, body;
+
+    if (next < 0) return -1;
+    switch (node->type) {
+    case RX_CHARS:
+        return rxAddState(re, RXS_CHARS, next, -1, node->set);
+    case RX_BOL:
+        return rxAddState(re, RXS_BOL, next, -1, -1);
+    case RX_EOL:
+        return rxAddState(re, RXS_EOL, next, -1, -1);
+    case RX_CAT:
+        //backwards, the text of b comes first
+        if (forward) return rxEmit(re, node->a, rxEmit(re, node->b, next, 1), 1);
+        return rxEmit(re, node->b, rxEmit(re, node->a, next, 0), 0);
+    case RX_ALT:
+        cur = rxEmit(re, node->a, next, forward);
+        body = rxEmit(re, node->b, next, forward);
+        return (cur < 0 || body < 0) ? -1 : rxAddState(re, RXS_SPLIT, cur, body, -1);
+    case RX_REPEAT:
+        cur = next;
+        if (node->max < 0) {
+            int loop = rxAddState(re, RXS_SPLIT, -1, next, -1);
+            body = rxEmit(re, node->a, loop, forward);
+            if (loop < 0 || body < 0) return -1;
+            re->states[loop].out = body;
+            cur = loop;
+        }
+        for (i = node->min; i < node->max && cur >= 0; i++) {
+            body = rxEmit(re, node->a, cur, forward);
+            cur = (body < 0) ? -1 : rxAddState(re, RXS_SPLIT, body, cur, -1);
+        }
+        for (i = 0; i < node->min && cur >= 0; i++) cur = rxEmit(re, node->a, cur, forward);
+        return cur;
+    }
+    return next;
+}
+
+void regexFree(struct regex *re) {
+    if (re == NULL) return;
+    free(re->nodes);
+    free(re->sets);
+    free(re->states);
+    free(re);
+}
+
+/**
+ * Compiles a pattern. Returns NULL if it is not valid, with the reason in
+ * *err.
+ */
+struct regex *regexCompile(const char *pattern, const char **err) {
+    struct regex *re = calloc(1, sizeof(struct regex));
+    struct rxParser ps = {re, pattern, NULL, 0};
+    char run[RX_MAX_LITERAL];
+    int runlen = 0;
+
+    int root = rxParseAlt(&ps);
+    if (root >= 0 && *ps.p == ')') ps.err = "unmatched )";
+    if (root >= 0 && ps.err == NULL) {
+        rxAddState(re, RXS_MATCH, -1, -1, -1);
+        re->start = rxEmit(re, root, 0, 0);
+        re->fstart = rxEmit(re, root, 0, 1);
+        if (re->start < 0 || re->fstart < 0) ps.err = "pattern too large";
+    }
+    if (ps.err) {
+        *err = ps.err;
+        regexFree(re);
+        return NULL;
+    }
+    rxFindLiteral(re, root, run, &runlen);
+    return re;
+}
+
+struct regexDfa *regexDfaNew(struct regex *re, int forward) {
+    struct regexDfa *d = calloc(1, sizeof(struct regexDfa));
+    int n = re->nstates;
+
+    d->re = re;
+    d->forward = forward;
+    d->matchEmpty = -1;
+    //every state is pushed at most once per edge into it, two per SPLIT
+    d->stack = malloc(sizeof(int) * (3 * n + 2));
+    d->seeds = malloc(sizeof(int) * (n + 1));
+    d->set = malloc(sizeof(int) * n);
+    d->bol = malloc(sizeof(int) * n);
+    d->mark = calloc(n, sizeof(int));
+    return d;
+}
+
+/**
+ * Drops every cached DFA state. Called when the cache is full, so patterns
+ * with a huge DFA cost time to rebuild states but never more memory.
+ */
+void rxFlush(struct regexDfa *d) {
+    int i;
+
+    for (i = 0; i < d->nstates; i++) {
+        free(d->states[i]->set);
+        free(d->states[i]);
+    }
+    d->nstates = 0;
+    d->initial[0] = d->initial[1] = NULL;
+    memset(d->table, 0, sizeof(d->table));
+}
+
+void regexDfaFree(struct regexDfa *d) {
+    if (d == NULL) return;
+    rxFlush(d);
+    free(d->stack);
+    free(d->seeds);
+    free(d->set);
+    free(d->bol);
+    free(d->mark);
+    free(d);
+}
+
+int rxCompareInt(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Follows the empty transitions from the seed states, through ^ only if
+ * atBol and through $ only if atEol. Writes the states reached that read a
+ * byte, match, or wait on an assertion to out, sorted, and returns how many.
+ */
+int rxClosure(struct regexDfa *d, const int *seeds, int nseeds, int atBol, int atEol,
+              int *out) {
+    struct regex *re = d->re;
+    int sp = 0, n = 0, i;
+
+    if (++d->stamp == 0x7fffffff) {
+        memset(d->mark, 0, sizeof(int) * re->nstates);
+        d->stamp = 1;
+    }
+    for (i = nseeds - 1; i >= 0; i--) d->stack[sp++] = seeds[i];
+    while (sp) {
+        int s = d->stack[--sp];
+        if (d->mark[s] == d->stamp) continue;
+        d->mark[s] = d->stamp;
+        rxState *st = &re->states[s];
+        if (st->type == RXS_SPLIT) {
+            d->stack[sp++] = st->out1;
+            d->stack[sp++] = st->out;
+        } else if ((st->type == RXS_BOL && atBol) || (st->type == RXS_EOL && atEol)) {
+            d->stack[sp++] = st->out;
+        } else {
+            out[n++] = s;
+        }
+    }
+    qsort(out, n, sizeof(int), rxCompareInt);
+    return n;
+}
+
+/**
+ * Returns the DFA state for a set of NFA states, adding it if it is new.
+ * Sets *flushed if the cache had to be emptied to make room.
+ */
+struct rxDState *rxStateFor(struct regexDfa *d, const int *set, int n, int *flushed) {
+    unsigned h = 2166136261u;
+    int i, slot;
+
+    for (i = 0; i < n; i++) h = (h ^ set[i]) * 16777619u;
+    for (slot = h & (RX_DFA_TABLE - 1); d->table[slot];
+         slot = (slot + 1) & (RX_DFA_TABLE - 1)) {
+        struct rxDState *ds = d->table[slot];
+        if (ds->n == n && memcmp(ds->set, set, sizeof(int) * n) == 0) return ds;
+    }
+    if (d->nstates == RX_DFA_MAX_STATES) {
+        rxFlush(d);
+        *flushed = 1;
+        return rxStateFor(d, set, n, flushed);
+    }
+    struct rxDState *ds = calloc(1, sizeof(struct rxDState));
+    ds->set = malloc(sizeof(int) * (n ? n : 1));
+    memcpy(ds->set, set, sizeof(int) * n);
+    ds->n = n;
+    ds->match = (n > 0 && set[0] == 0); //the match state is NFA state 0
+    n = rxClosure(d, ds->set, n, !d->forward, d->forward, d->bol);
+    ds->matchAtEdge = (n > 0 && d->bol[0] == 0);
+    d->table[slot] = ds;
+    d->states[d->nstates++] = ds;
+    return ds;
+}
+
+/**
+ * Computes the state after reading byte c back from state from, and caches
+ * it as a transition of from.
+ */
+struct rxDState *rxStep(struct regexDfa *d, struct rxDState *from, unsigned char c) {
+    struct regex *re = d->re;
+    int i, n = 0, flushed = 0;
+
+    for (i = 0; i < from->n; i++) {
+        rxState *st = &re->states[from->set[i]];
+        if (st->type == RXS_CHARS && RX_HAS(re->sets[st->set], c)) d->seeds[n++] = st->out;
+    }
+    //a match may also end right before c, which is where reading it starts
+    if (!d->forward) d->seeds[n++] = re->start;
+    n = rxClosure(d, d->seeds, n, 0, 0, d->set);
+    struct rxDState *to = rxStateFor(d, d->set, n, &flushed);
+    if (!flushed) from->next[c] = to;
+    return to;
+}
+
+/**
+ * The state reading a row starts in: backwards from its end, or forwards from
+ * column 0 if bol is set and from any other column if not.
+ */
+struct rxDState *rxFirstState(struct regexDfa *d, int bol) {
+    int k = d->forward ? bol : 0, n, flushed = 0;
+
+    if (d->initial[k] == NULL) {
+        if (d->forward) n = rxClosure(d, &d->re->fstart, 1, bol, 0, d->set);
+        else n = rxClosure(d, &d->re->start, 1, 0, 1, d->set); //$ holds at the end
+        d->initial[k] = rxStateFor(d, d->set, n, &flushed);
+    }
+    return d->initial[k];
+}
+
+/**
+ * Finds the matches of a regex in a row that start at columns lo to hi - 1.
+ * Returns how many there are, with the first and the last of them in *first
+ * and *last. The row is read backwards from its end down to column lo.
+ */
+long regexHits(struct regexDfa *d, const char *line, long len, long lo, long hi,
+               long *first, long *last) {
+    struct rxDState *s;
+    long count = 0, p;
+
+    *first = *last = -1;
+    if (lo > len) return 0;
+    if (len == 0) {
+        //column 0 is both the start and the end of the row
+        if (d->matchEmpty < 0) {
+            int n = rxClosure(d, &d->re->start, 1, 1, 1, d->set);
+            d->matchEmpty = (n > 0 && d->set[0] == 0);
+        }
+        if (!d->matchEmpty || hi <= 0) return 0;
+        *first = *last = 0;
+        return 1;
+    }
+    s = rxFirstState(d, 0);
+    for (p = len; p > lo; p--) {
+        if (s->match && p < hi) {
+            if (count++ == 0) *last = p;
+            *first = p;
+        }
+        unsigned char c = line[p - 1];
+        struct rxDState *t = s->next[c];
+        s = t ? t : rxStep(d, s, c);
+    }
+    if ((p == 0 ? s->matchAtEdge : s->match) && p < hi) {
+        if (count++ == 0) *last = p;
+        *first = p;
+    }
+    return count;
+}
+
+/**
+ * Writes the column of every match start in a row to starts, which has room
+ * for len + 1 of them, from the last one down. Returns how many there are.
+ */
+long regexStarts(struct regexDfa *d, const char *line, long len, long *starts) {
+    long n = 0, p, first, last;
+
+    if (len == 0) {
+        if (regexHits(d, line, 0, 0, 1, &first, &last)) starts[n++] = 0;
+        return n;
+    }
+    struct rxDState *s = rxFirstState(d, 0);
+    for (p = len; p > 0; p--) {
+        if (s->match) starts[n++] = p;
+        unsigned char c = line[p - 1];
+        struct rxDState *t = s->next[c];
+        s = t ? t : rxStep(d, s, c);
+    }
+    if (s->matchAtEdge) starts[n++] = 0;
+    return n;
+}
+
+/**
+ * Returns where the longest match starting at column s of a row ends, or -1
+ * if none does. d must read forwards.
+ */
+long regexMatchEnd(struct regexDfa *d, const char *line, long len, long s) {
+    long p, end = -1;
+    int bol = (s == 0);
+
+    if (s == len) {
+        //both assertions may hold at once, which no cached state knows
+        int n = rxClosure(d, &d->re->fstart, 1, bol, 1, d->set);
+        return (n > 0 && d->set[0] == 0) ? s : -1;
+    }
+    struct rxDState *st = rxFirstState(d, bol);
+    for (p = s; p < len && st->n > 0; p++) {
+        if (st->match) end = p;
+        unsigned char c = line[p];
+        struct rxDState *t = st->next[c];
+        st = t ? t : rxStep(d, st, c);
+    }
+    if (p == len ? st->matchAtEdge : st->match) end = p;
+    return end;
+}
+
+/** ======================== Find Functions============================*/
+
+// Needles longer than this are searched with memmem(), whose Two-Way
+// algorithm stays linear however the text repeats.
+#define SEARCH_LONG_NEEDLE 32
+
+/**
+ * Portable searcher: memchr() for the first byte of the needle, memcmp() for
+ * the rest.
+ */
+const char *searchTextScalar(const char *text, size_t n, const char *q, size_t qlen) {
+    const char *p = text, *last;
+
+    if (qlen == 0 || qlen > n) return NULL;
+    last = text + n - qlen + 1; //one past the last possible start
+    while (p < last && (p = memchr(p, q[0], last - p)) != NULL) {
+        if (memcmp(p + 1, q + 1, qlen - 1) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * SSE2 searcher: compares 16 possible starts at a time against the first and
+ * the last byte of the needle. Only starts where both match are verified with
+ * memcmp(), which on real text are rare.
+ */
+__attribute__((target("sse2")))
+const char *searchTextSSE2(const char *text, size_t n, const char *q, size_t qlen) {
+    if (qlen < 2) return (qlen && n) ? memchr(text, q[0], n) : NULL;
+    const __m128i first = _mm_set1_epi8(q[0]);
+    const __m128i last = _mm_set1_epi8(q[qlen - 1]);
+    size_t pos = 0;
+
+    for (; pos + qlen - 1 + 16 <= n; pos += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(text + pos));
+        __m128i b = _mm_loadu_si128((const __m128i *)(text + pos + qlen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            const char *p = text + pos + __builtin_ctz(mask);
+            if (memcmp(p + 1, q + 1, qlen - 2) == 0) return p;
+            mask &= mask - 1;
+        }
+    }
+    return searchTextScalar(text + pos, n - pos, q, qlen);
+}
+
+/**
+ * AVX2 searcher: same as the SSE2 one, 32 starts at a time.
+ */
+__attribute__((target("avx2")))
+const char *searchTextAVX2(const char *text, size_t n, const char *q, size_t qlen) {
+    if (qlen < 2) return (qlen && n) ? memchr(text, q[0], n) : NULL;
+    const __m256i first = _mm256_set1_epi8(q[0]);
+    const __m256i last = _mm256_set1_epi8(q[qlen - 1]);
+    size_t pos = 0;
+
+    for (; pos + qlen - 1 + 32 <= n; pos += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(text + pos));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(text + pos + qlen - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            const char *p = text + pos + __builtin_ctz(mask);
+            if (memcmp(p + 1, q + 1, qlen - 2) == 0) return p;
+            mask &= mask - 1;
+        }
+    }
+    return searchTextScalar(text + pos, n - pos, q, qlen);
+}
+#endif
+
+typedef const char *(*textSearcher)(const char *, size_t, const char *, size_t);
+
+/**
+ * Picks the fastest searcher the CPU supports, once.
+ */
+textSearcher searchTextImpl() {
+    static textSearcher impl = NULL;
+
+    if (impl) return impl;
+    impl = searchTextScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) impl = searchTextAVX2;
+    else if (__builtin_cpu_supports("sse2")) impl = searchTextSSE2;
+#endif
+    return impl;
+}
+
+/**
+ * Returns the first occurrence of q in the n bytes at text, or NULL.
+ */
+const char *searchText(const char *text, size_t n, const char *q, size_t qlen) {
+    if (qlen > SEARCH_LONG_NEEDLE) return memmem(text, n, q, qlen);
+    return searchTextImpl()(text, n, q, qlen);
+}
+
+/**
+ * Counts the occurrences of q in the n bytes at text, overlapping ones too.
+ */
+long searchCount(const char *text, size_t n, const char *q, size_t qlen) {
+    const char *p = text, *end = text + n;
+    long count = 0;
+
+    while ((p = searchText(p, end - p, q, qlen)) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+/**
+ * Number of matches of a query in a row that start at columns lo to hi - 1,
+ * with the first and the last of them in *first and *last.
+ */
+long lineHits(struct searchQuery *sq, const char *line, long len, long lo, long hi,
+              long *first, long *last) {
+    const char *p = line + lo, *end = line + len;
+    long count = 0;
+
+    if (sq->re) {
+        if (sq->litlen && !searchText(line, len, sq->lit, sq->litlen)) return 0;
+        return regexHits(sq->dfa, line, len, lo, hi, first, last);
+    }
+    *first = *last = -1;
+    if (lo > len) return 0;
+    while ((p = searchText(p, end - p, sq->lit, sq->litlen)) != NULL && p - line < hi) {
+        if (count++ == 0) *first = p - line;
+        *last = p - line;
+        p++;
+    }
+    return count;
+}
+
+/**
+ * Row of a lazy block holding byte offset off of its text, looking from row
+ * lo on.
+ */
+int blockRowAt(rowBlock *blk, size_t off, int lo) {
+    int hi = blk->count - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (blk->lineOff[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * Finds the first match at or after column col of row row of a block, and
+ * returns 1 with its position in *mrow and *mcol. The text of a lazy block is
+ * searched in one go for the literal of the query: a match cannot span lines
+ * as queries hold no newlines. A regex then only reads the rows holding it.
+ */
+int blockFindFrom(rowBlock *blk, struct searchQuery *sq, int row, long col,
+                  int *mrow, long *mcol) {
+    int j;
+    long len, first, last;
+
+    if (!blk->rows && sq->litlen) {
+        if (row >= blk->count) return 0;
+        const char *from = blk->base + blk->lineOff[row] + col;
+        const char *end = blk->base + blk->end;
+        while (from < end) {
+            const char *p = searchText(from, end - from, sq->lit, sq->litlen);
+            if (p == NULL) return 0;
+            j = blockRowAt(blk, p - blk->base, row);
+            if (!sq->re) {
+                *mrow = j;
+                *mcol = p - blk->base - blk->lineOff[j];
+                return 1;
+            }
+            const char *line = blockLine(blk, j, &len);
+            if (regexHits(sq->dfa, line, len, (j == row) ? col : 0, len + 1, &first, &last)) {
+                *mrow = j;
+                *mcol = first;
+                return 1;
+            }
+            if (j + 1 == blk->count) return 0;
+            row = j + 1;
+            from = blk->base + blk->lineOff[row];
+        }
+        return 0;
+    }
+    for (j = row; j < blk->count; j++, col = 0) {
+        const char *line = blockLine(blk, j, &len);
+        if (lineHits(sq, line, len, col, len + 1, &first, &last)) {
+            *mrow = j;
+            *mcol = first;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Number of matches in a block.
+ */
+long blockCountMatches(rowBlock *blk, struct searchQuery *sq) {
+    long count = 0, len, first, last;
+    int j;
+
+    if (!blk->rows && !sq->re) {
+        const char *from = blk->base + blk->lineOff[0];
+        return searchCount(from, blk->base + blk->end - from, sq->lit, sq->litlen);
+    }
+    if (!blk->rows && sq->litlen) {
+        //only the rows holding the literal can match
+        const char *from = blk->base + blk->lineOff[0];
+        const char *end = blk->base + blk->end, *p;
+        j = 0;
+        while ((p = searchText(from, end - from, sq->lit, sq->litlen)) != NULL) {
+            j = blockRowAt(blk, p - blk->base, j);
+            const char *line = blockLine(blk, j, &len);
+            count += regexHits(sq->dfa, line, len, 0, len + 1, &first, &last);
+            if (++j == blk->count) break;
+            from = blk->base + blk->lineOff[j];
+        }
+        return count;
+    }
+    for (j = 0; j < blk->count; j++) {
+        const char *line = blockLine(blk, j, &len);
+        count += lineHits(sq, line, len, 0, len + 1, &first, &last);
+    }
+    return count;
+}
+
+/**
+ * Finds the last match of a block that starts before column col of row row.
+ * Returns the number of matches before that position, so 0 if none.
+ */
+long blockFindBefore(rowBlock *blk, struct searchQuery *sq, int row, long col,
+                     int *mrow, long *mcol) {
+    int j;
+    long count = 0, n, len, first, last;
+
+    for (j = 0; j <= row && j < blk->count; j++) {
+        const char *line = blockLine(blk, j, &len);
+        n = lineHits(sq, line, len, 0, (j == row) ? col : len + 1, &first, &last);
+        if (n) {
+            count += n;
+            *mrow = j;
+            *mcol = last;
+        }
+    }
+    return count;
+}
+
+// Blocks handed to a search worker at a time.
+#define FIND_CHUNK_BLOCKS 64
+
+/**
+ * Search worker. Takes chunks of blocks in order, starting next to the
+ * cursor, counts the matches in each block of the snapshot and publishes the
+ * counts of every finished chunk. Stops between two blocks when cancelled.
+ */
+void *findWorker(void *arg) {
+    struct findJob *job = arg;
+    struct searchQuery query = job->query;
+    int nblocks = job->snap.nblocks;
+    int k, i, cancel;
+
+    if (query.re) query.dfa = regexDfaNew(query.re, 0);
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        cancel = job->cancel;
+        k = job->nextChunk++;
+        pthread_mutex_unlock(&job->lock);
+        if (cancel || k >= job->nchunks) break;
+
+        for (i = 0; i < FIND_CHUNK_BLOCKS && k * FIND_CHUNK_BLOCKS + i < nblocks; i++) {
+            int b = (job->first + k * FIND_CHUNK_BLOCKS + i) % nblocks;
+            job->counts[b] = blockCountMatches(job->snap.blocks[b], &query);
+            pthread_mutex_lock(&job->lock);
+            cancel = job->cancel;
+            pthread_mutex_unlock(&job->lock);
+            if (cancel) break;
+        }
+        if (cancel) break;
+        pthread_mutex_lock(&job->lock);
+        job->chunkDone[k] = 1;
+        pthread_mutex_unlock(&job->lock);
+        editorWake();
+    }
+    regexDfaFree(query.dfa);
+    return NULL;
+}
+
+/**
+ * Stops the search running in the background, if any. Workers notice within
+ * one block, so this does not keep the UI waiting.
+ */
+void editorFindCancel() {
+    struct findJob *job = &editC.findJob;
+    int t;
+
+    if (!job->running) return;
+    pthread_mutex_lock(&job->lock);
+    job->cancel = 1;
+    pthread_mutex_unlock(&job->lock);
+    for (t = 0; t < job->nthreads; t++) pthread_join(job->tids[t], NULL);
+    job->running = 0;
+    snapshotRelease(&job->snap);
+    pthread_mutex_destroy(&job->lock);
+    free(job->counts);
+    free(job->chunkDone);
+}
+
+/**
+ * Number of the match at the cursor, counting the matches of the blocks
+ * before it; 0 while some of them are not counted yet. Blocks the loader
+ * added since the count started are not counted.
+ */
+void editorFindNumber() {
+    int b, idx, mrow;
+    long current, mcol;
+
+    editC.find.current = 0;
+    b = storeLocate(&editC.text, editC.cy, &idx);
+    if (b >= editC.find.nblocks) return;
+    current = blockFindBefore(editC.text.blocks[b], &editC.find.query, idx, editC.cx,
+                              &mrow, &mcol) + 1;
+    while (b-- > 0) {
+        if (editC.find.blockMatches[b] < 0) return;
+        current += editC.find.blockMatches[b];
+    }
+    editC.find.current = current;
+}
+
+/**
+ * Sets up editC.find.query for the text typed: plain text, or with
+ * editC.find.regex the regex compiled from it. Returns 0 if the regex does not
+ * compile, with the reason in editC.find.error.
+ */
+int editorFindCompile(const char *text) {
+    struct searchQuery *sq = &editC.find.query;
+    char *copy = strdup(text);
+
+    regexDfaFree(sq->dfa);
+    regexFree(sq->re);
+    free(editC.find.text);
+    memset(sq, 0, sizeof(*sq));
+    editC.find.text = copy;
+    editC.find.qlen = strlen(copy);
+    editC.find.error = NULL;
+    if (!editC.find.regex) {
+        sq->lit = copy;
+        sq->litlen = editC.find.qlen;
+        return 1;
+    }
+    if (editC.find.qlen == 0) return 1;
+    sq->re = regexCompile(copy, &editC.find.error);
+    if (sq->re == NULL) return 0;
+    sq->lit = sq->re->lit;
+    sq->litlen = sq->re->litlen;
+    sq->dfa = regexDfaNew(sq->re, 0);
+    return 1;
+}
+
+/**
+ * Searches the whole document for query, counting the matches of each block.
+ * The counts let jumps skip blocks without a match and tell the number of a
+ * match without counting again.
+ * Large documents are searched by a pool of worker threads, on a snapshot of
+ * the document. Counts are -1 until known; they arrive in editorFindPoll()
+ * while the user keeps typing, and a new query cancels the old search.
+ */
+void editorFindAll(const char *query) {
+    struct textStore *ts = &editC.text;
+    struct findJob *job = &editC.findJob;
+    int b, t;
+
+    editorFindCancel();
+    int valid = editorFindCompile(query) && editC.find.qlen > 0;
+    editC.find.blockMatches = realloc(editC.find.blockMatches,
+                                      sizeof(long) * (ts->nblocks ? ts->nblocks : 1));
+    editC.find.nblocks = ts->nblocks;
+    editC.find.total = 0;
+    editC.find.current = 0;
+    if (!valid || ts->nblocks <= FIND_CHUNK_BLOCKS) {
+        //small enough to count right away
+        for (b = 0; b < ts->nblocks; b++) {
+            editC.find.blockMatches[b] = valid ?
+                blockCountMatches(ts->blocks[b], &editC.find.query) : 0;
+            editC.find.total += editC.find.blockMatches[b];
+        }
+        return;
+    }
+
+    for (b = 0; b < ts->nblocks; b++) editC.find.blockMatches[b] = -1;
+    storeSnapshot(ts, &job->snap);
+    job->query = editC.find.query;
+    job->query.dfa = NULL;
+    job->first = storeLocate(ts, editC.find.cy, &t) % ts->nblocks;
+    job->nchunks = (ts->nblocks + FIND_CHUNK_BLOCKS - 1) / FIND_CHUNK_BLOCKS;
+    job->nextChunk = 0;
+    job->counts = malloc(sizeof(long) * ts->nblocks);
+    job->chunkDone = calloc(job->nchunks, 1);
+    job->cancel = 0;
+    pthread_mutex_init(&job->lock, NULL);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    job->nthreads = (ncpu < 1) ? 1 : (ncpu > FIND_MAX_THREADS ? FIND_MAX_THREADS : ncpu);
+    if (job->nthreads > job->nchunks) job->nthreads = job->nchunks;
+    for (t = 0; t < job->nthreads; t++) {
+        if (pthread_create(&job->tids[t], NULL, findWorker, job) != 0) break;
+    }
+    job->nthreads = t;
+    job->running = 1;
+    if (t == 0) {
+        //no thread to spare: search right here instead
+        findWorker(job);
+        editorFindPoll();
+    }
+}
+
+/**
+ * Jumps to the first match at or after the place the search started from,
+ * as soon as the blocks up to it are counted. Returns 0 while that is not
+ * known yet.
+ */
+int editorFindFirst() {
+    struct textStore *ts = &editC.text;
+    int b0, idx, n, mrow;
+    long col = editC.find.cx, mcol;
+
+    if (ts->nblocks == 0) return 1;
+    b0 = storeLocate(ts, editC.find.cy, &idx);
+    if (b0 == ts->nblocks) {
+        b0 = 0;
+        idx = col = 0;
+    }
+    //every block in order from the cursor, then the start of its own block
+    for (n = 0; n <= ts->nblocks; n++) {
+        int b = (b0 + n) % ts->nblocks;
+        //blocks the loader added since the count started are not counted yet
+        long count = b < editC.find.nblocks ? editC.find.blockMatches[b] : -1;
+        if (count < 0) return 0;
+        if (count > 0 && blockFindFrom(ts->blocks[b], &editC.find.query, idx, col,
+                                       &mrow, &mcol)) {
+            editC.cy = storeBlockStart(ts, b) + mrow;
+            editC.cx = mcol;
+            editorFindNumber();
+            return 1;
+        }
+        idx = col = 0;
+    }
+    return 1;
+}
+
+/**
+ * Called by the UI thread when search workers have published counts. Moves
+ * the cursor to the first match once it is known. Returns 1 if anything
+ * changed.
+ */
+int editorFindPoll() {
+    struct findJob *job = &editC.findJob;
+    int k, i, all = 1, changed = 0;
+
+    if (!job->running) return 0;
+    pthread_mutex_lock(&job->lock);
+    for (k = 0; k < job->nchunks; k++) {
+        if (job->chunkDone[k] == 0) all = 0;
+        if (job->chunkDone[k] != 1) continue;
+        for (i = 0; i < FIND_CHUNK_BLOCKS && k * FIND_CHUNK_BLOCKS + i < job->snap.nblocks; i++) {
+            int b = (job->first + k * FIND_CHUNK_BLOCKS + i) % job->snap.nblocks;
+            editC.find.blockMatches[b] = job->counts[b];
+            editC.find.total += job->counts[b];
+        }
+        job->chunkDone[k] = 2;
+        changed = 1;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (all) editorFindCancel();
+    //the loader may have added lines while the workers counted
+    if (all && editC.find.nblocks != editC.text.nblocks) {
+        editorFindAll(editC.find.text);
+        changed = 1;
+    }
+    if (editC.find.pending && editorFindFirst()) editC.find.pending = 0;
+    else if (!editC.find.pending && editC.find.current == 0 && all) editorFindNumber();
+    return changed;
+}
+
+/**
+ * Moves the cursor to the next match at or after row, col, or with dir -1 to
+ * the last match before it, wrapping around the end of the document.
+ * Blocks not counted yet by the workers are searched right here.
+ * Returns 0 if there is no match at all.
+ */
+int editorFindFrom(int row, long col, int dir) {
+    struct textStore *ts = &editC.text;
+    struct searchQuery *sq = &editC.find.query;
+    int b, idx, n, mrow = 0;
+    long mcol = 0;
+
+    //the loader may have added lines since the matches were counted
+    if (editC.find.nblocks != ts->nblocks) editorFindAll(editC.find.text);
+    if (editC.find.total == 0 && !editC.findJob.running) return 0;
+    b = storeLocate(ts, row, &idx);
+    if (b == ts->nblocks) {
+        //past the last row: the search starts over at the top, or from the end
+        b = (dir > 0) ? 0 : ts->nblocks - 1;
+        idx = (dir > 0) ? 0 : ts->blocks[b]->count;
+        col = 0;
+    }
+    for (n = 0; n <= ts->nblocks; n++) {
+        rowBlock *blk = ts->blocks[b];
+        if (editC.find.blockMatches[b] != 0) {
+            if (dir > 0 && blockFindFrom(blk, sq, idx, col, &mrow, &mcol)) break;
+            if (dir < 0 && blockFindBefore(blk, sq, idx, col, &mrow, &mcol)) break;
+        }
+        b = (b + dir + ts->nblocks) % ts->nblocks;
+        idx = (dir > 0) ? 0 : ts->blocks[b]->count;
+        col = 0;
+    }
+    if (n > ts->nblocks) return 0;
+
+    editC.cy = storeBlockStart(ts, b) + mrow;
+    editC.cx = mcol;
+    editorFindNumber();
+    return 1;
+}
+
+/**
+ * Called by editorPrompt() after every key while searching. Typing searches
+ * again from where the search started, and so does Ctrl-R, which switches
+ * between plain text and regex. The arrow keys jump to the next (right,
+ * down) or previous (left, up) match.
+ */
+void editorFindCallback(char *query, int key) {
+    if (key == '\r' || key == '\x1b') {
+        editorFindCancel();
+        return;
+    }
+
+    if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        editC.find.pending = 0;
+        editorFindFrom(editC.cy, editC.cx + 1, 1);
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        editC.find.pending = 0;
+        editorFindFrom(editC.cy, editC.cx, -1);
+    } else {
+        if (key == CTRL_KEY('r')) editC.find.regex = !editC.find.regex;
+        editC.cx = editC.find.cx;
+        editC.cy = editC.find.cy;
+        editorFindAll(query);
+        editC.find.pending = !editorFindFirst();
+    }
+}
+
+/**
+ * Lets the user type a query, searching incrementally over the text of the
+ * rows. The cursor follows the matches while the query is typed; Esc puts it
+ * back where it was. Returns NULL if the search was cancelled or the regex
+ * does not compile.
+ */
+char *editorFindPrompt(char *prompt) {
+    editC.find.cx = editC.cx;
+    editC.find.cy = editC.cy;
+    editC.find.rowoffset = editC.rowoffset;
+    editC.find.coloffset = editC.coloffset;
+    editC.find.wrapseg = editC.wrap.seg;
+    editC.find.total = 0;
+    editC.find.pending = 0;
+    editC.find.active = 1;
+
+    char *query = editorPrompt(prompt, editorFindCallback);
+    editC.find.active = 0;
+    if (query == NULL) {
+        editC.cx = editC.find.cx;
+        editC.cy = editC.find.cy;
+        editC.rowoffset = editC.find.rowoffset;
+        editC.coloffset = editC.find.coloffset;
+        editC.wrap.seg = editC.find.wrapseg;
+        return NULL;
+    }
+    if (editC.find.error) {
+        editorSetStatusMsg("Bad regex: %s", editC.find.error);
+        free(query);
+        return NULL;
+    }
+    return query;
+}
+
+/**
+ * Incremental search, see editorFindPrompt().
+ */
+void editorFind() {
+    char *query = editorFindPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R regex)");
+    if (query == NULL) return;
+
+    //Enter may have cut a background search short
+    int complete = 1, b;
+    for (b = 0; b < editC.find.nblocks; b++)
+        if (editC.find.blockMatches[b] < 0) complete = 0;
+    editorSetStatusMsg("%ld%s matches for \"%s\"", editC.find.total,
+                       complete ? "" : "+", query);
+    free(query);
+}
+
+/** ======================== Replace Functions ============================*/
+
+/**
+ * Appends row line to out with every match of a query replaced by with.
+ * Matches are taken from the left without overlapping, each regex match as
+ * long as it can be; like sed, an empty match right after a match is skipped.
+ * starts has room for len + 1 columns; fwd reads the regex forwards.
+ * Returns the number of matches replaced.
+ */
+long lineReplace(struct searchQuery *sq, struct regexDfa *fwd, const char *line, long len,
+                 const char *with, int wlen, long *starts, struct appendBuf *out) {
+    const char *p;
+    long count = 0, pos = 0, last = -1, n, s, e;
+
+    if (!sq->re) {
+        while ((p = searchText(line + pos, len - pos, sq->lit, sq->litlen)) != NULL) {
+            appendToBuffer(out, line + pos, p - line - pos);
+            appendToBuffer(out, with, wlen);
+            pos = p - line + sq->litlen;
+            count++;
+        }
+    } else {
+        //the starts come from the last one down
+        for (n = regexStarts(sq->dfa, line, len, starts); n-- > 0; ) {
+            s = starts[n];
+            if (s < pos || (e = regexMatchEnd(fwd, line, len, s)) < 0) continue;
+            if (e == s && s == last) continue;
+            appendToBuffer(out, line + pos, s - pos);
+            appendToBuffer(out, with, wlen);
+            count++;
+            pos = last = e;
+            if (e == s) {
+                //an empty match: the byte after it stays
+                if (s < len) appendToBuffer(out, line + s, 1);
+                pos = s + 1;
+            }
+        }
+    }
+    if (pos < len) appendToBuffer(out, line + pos, len - pos);
+    return count;
+}
 
-    int i;
-    for(i=0; i < editC.num_rows;i++) {
-        erow *row = &editC.row[i];
-        char *match = strstr(row->render,query);
-        if (match) {
-            editC.cy = i;
-            editC.cx = match - row->render;
-            editC.rowoffset = editC.num_rows;
-            break;
+/**
+ * Builds the new text of every row of block b with a match.
+ */
+void replaceInBlock(struct replaceJob *job, int b, struct searchQuery *sq,
+                    struct regexDfa *fwd, long **starts, long *startsCap,
+                    struct appendBuf *out, struct textSlab *slab) {
+    rowBlock *blk = job->blocks[b];
+    struct replaceBlock *rb = &job->out[b];
+    int row = 0;
+    long col, len;
+
+    while (blockFindFrom(blk, sq, row, 0, &row, &col)) {
+        const char *line = blockLine(blk, row, &len);
+        if (sq->re && len + 1 > *startsCap) {
+            *startsCap = len + 1;
+            *starts = realloc(*starts, sizeof(long) * *startsCap);
+        }
+        out->len = 0;
+        long count = lineReplace(sq, fwd, line, len, job->with, job->wlen, *starts, out);
+        if (rb->n == rb->cap) {
+            rb->cap = rb->cap ? rb->cap * 2 : 16;
+            rb->rows = realloc(rb->rows, sizeof(struct replaceRow) * rb->cap);
+        }
+        struct replaceRow *rr = &rb->rows[rb->n++];
+        rr->row = row++;
+        rr->size = out->len;
+        rr->chars = slabAlloc(slab, out->len + 1);
+        if (out->len) memcpy(rr->chars, out->buf, out->len);
+        rr->chars[out->len] = '\0';
+        rr->flags = 0;
+        rb->count += count;
+    }
+}
+
+/**
+ * Replace worker. Takes chunks of blocks in order and builds the new text of
+ * their rows, with DFAs of its own for a regex.
+ */
+void *replaceWorker(void *arg) {
+    struct replaceJob *job = arg;
+    struct searchQuery query = job->query;
+    struct regexDfa *fwd = NULL;
+    struct appendBuf out = BUFFER_INIT;
+    struct textSlab slab;
+    long *starts = NULL, startsCap = 0;
+    int k, b;
+
+    memset(&slab, 0, sizeof(slab));
+    if (query.re) {
+        query.dfa = regexDfaNew(query.re, 0);
+        fwd = regexDfaNew(query.re, 1);
+    }
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        k = job->nextChunk++;
+        pthread_mutex_unlock(&job->lock);
+        if (k * FIND_CHUNK_BLOCKS >= job->nblocks) break;
+        for (b = k * FIND_CHUNK_BLOCKS; b < (k + 1) * FIND_CHUNK_BLOCKS && b < job->nblocks; b++)
+            replaceInBlock(job, b, &query, fwd, &starts, &startsCap, &out, &slab);
+    }
+    pthread_mutex_lock(&job->lock);
+    slabMerge(&job->slab, &slab);
+    pthread_mutex_unlock(&job->lock);
+    regexDfaFree(query.dfa);
+    regexDfaFree(fwd);
+    free(starts);
+    free(out.buf);
+    return NULL;
+}
+
+/**
+ * Swaps the text of a row with the one kept in rr.
+ */
+void replaceSwap(erow *row, struct replaceRow *rr) {
+    struct replaceRow old = {0, rowChars(row), row->size, row->flags & ROW_BORROWED};
+
+    if (row->flags & ROW_INLINE) {
+        //rr keeps text in a slab block; the row may take it back as it is
+        old.chars = slabAlloc(&editC.slab, row->size + 1);
+        memcpy(old.chars, row->text, row->size + 1);
+    }
+    rowSetChars(row, rr->chars);
+    row->size = rr->size;
+    row->flags = (row->flags & ~(ROW_BORROWED | ROW_INLINE)) | rr->flags;
+    editorUpdateRow(row);
+    rr->chars = old.chars;
+    rr->size = old.size;
+    rr->flags = old.flags;
+}
+
+/**
+ * Replaces every match of the current search with with. Worker threads take
+ * chunks of blocks and build the new text of each row with a match in one
+ * go; the UI thread waits, then swaps the new text in. A row is rewritten
+ * once whatever its number of matches, and the old text is kept so that the
+ * whole replace is undone at once, see editorUndo().
+ */
+void editorReplaceAll(const char *with) {
+    struct textStore *ts = &editC.text;
+    struct replaceJob job;
+    pthread_t tids[FIND_MAX_THREADS];
+    long count = 0, nrows = 0;
+    int b, t, j, start, nthreads;
+
+    editorFindCancel();
+    memset(&job, 0, sizeof(job));
+    job.query = editC.find.query;
+    job.query.dfa = NULL;
+    job.with = with;
+    job.wlen = strlen(with);
+    job.blocks = ts->blocks;
+    job.nblocks = ts->nblocks;
+    job.out = calloc(ts->nblocks ? ts->nblocks : 1, sizeof(struct replaceBlock));
+    pthread_mutex_init(&job.lock, NULL);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = (ncpu < 1) ? 1 : (ncpu > FIND_MAX_THREADS ? FIND_MAX_THREADS : ncpu);
+    for (t = 0; t < nthreads; t++) {
+        if (pthread_create(&tids[t], NULL, replaceWorker, &job) != 0) break;
+    }
+    nthreads = t;
+    //no thread to spare: replace right here instead
+    if (nthreads == 0) replaceWorker(&job);
+    for (t = 0; t < nthreads; t++) pthread_join(tids[t], NULL);
+    pthread_mutex_destroy(&job.lock);
+    slabMerge(&editC.slab, &job.slab);
+
+    for (b = 0; b < ts->nblocks; b++) {
+        count += job.out[b].count;
+        nrows += job.out[b].n;
+    }
+    if (count == 0) {
+        free(job.out);
+        editorSetStatusMsg("No matches to replace.");
+        return;
+    }
+    struct replaceUndo *ru = malloc(sizeof(*ru));
+    ru->rows = malloc(sizeof(struct replaceRow) * nrows);
+    ru->nrows = 0;
+    ru->count = count;
+    ru->bytes = sizeof(*ru) + sizeof(struct replaceRow) * nrows;
+    for (b = 0, start = 0; b < ts->nblocks; start += ts->blocks[b++]->count) {
+        struct replaceBlock *rb = &job.out[b];
+        if (rb->n == 0) continue;
+        rowBlock *blk = storeWritable(ts, b);
+        storeMaterialize(blk);
+        editorSyntaxInvalidate(start);
+        storeMarkBytes(ts, b);
+        blk->wrapCols = 0; //the whole block is laid out again
+        for (j = 0; j < rb->n; j++) {
+            struct replaceRow *rr = &ru->rows[ru->nrows++];
+            *rr = rb->rows[j];
+            replaceSwap(&blk->rows[rr->row], rr);
+            ru->bytes += rr->size + 1;
+            rr->row += start;
         }
+        free(rb->rows);
+    }
+    free(job.out);
+
+    editC.dirtyFlag++;
+    editC.undo.extra += ru->bytes;
+    undoPush(U_REPLACE, editC.undo.row, 0, (const char *)&ru, sizeof(ru));
+    if (editC.cy < editC.num_rows && editC.cx > editorRowAt(editC.cy)->size)
+        editC.cx = editorRowAt(editC.cy)->size;
+    editorSetStatusMsg("Replaced %ld matches on %ld lines. Ctrl-Z to undo.", count, nrows);
+}
+
+/**
+ * Replaces every match of a query with a string typed by the user. The query
+ * is typed as in editorFind(), so its matches show while it is typed.
+ */
+void editorReplace() {
+    if (editorLoading()) {
+        editorSetStatusMsg("Still loading the file, try again when done.");
+        return;
+    }
+    char *query = editorFindPrompt("Replace: %s (Use ESC/Arrows/Enter, Ctrl-R regex)");
+    if (query == NULL) return;
+    char *with = editorPromptInput("Replace with: %s", NULL, 1);
+    if (with == NULL) {
+        editorSetStatusMsg("Replace aborted.");
+    } else {
+        editorReplaceAll(with);
+        free(with);
     }
     free(query);
 }
-/** ======================== All write buffer handling goes here. ===================*/
-struct appendBuf {
-    char *buf;
-    int  len;
+
+/** ======================== Go to line ============================================ */
+
+/**
+ * Puts the cursor at byte col of row at, or at the start of the character
+ * col falls in, and scrolls the row to the middle of the screen.
+ */
+void editorJumpTo(int at, long col) {
+    editC.cy = at;
+    editC.cx = 0;
+    if (at < editC.num_rows) {
+        erow *row = editorRowAt(at);
+        editC.cx = col < row->size ? utf8Start(rowChars(row), row->size, col) : row->size;
+    }
+    editC.rowoffset = at > editC.screen_rows / 2 ? at - editC.screen_rows / 2 : 0;
+    editC.wrap.seg = 0;
+}
+
+/**
+ * Asks for a line number, or for @ and a byte offset into the document as
+ * saved, in decimal or 0x hex, and moves the cursor there. Both are found in
+ * O(log n) from the trees of the text store, see storeOffsetRow().
+ */
+void editorGoTo() {
+    char *input = editorPrompt("Go to line: %s (or @byte offset)", NULL);
+    char *end;
+
+    if (input == NULL) return;
+    int offset = input[0] == '@';
+    const char *num = input + offset;
+    int hex = num[0] == '0' && (num[1] == 'x' || num[1] == 'X');
+    errno = 0;
+    long n = strtol(num, &end, hex ? 16 : 10);
+    if (end == num || *end != '\0' || n < 0 || errno) {
+        editorSetStatusMsg("Not a %s: %s", offset ? "byte offset" : "line number", num);
+    } else if (offset) {
+        long col;
+        int at = storeOffsetRow(&editC.text, n, &col);
+        editorJumpTo(at, col);
+    } else {
+        //lines are counted from 1; past the end is the last line
+        if (n > editC.num_rows) n = editC.num_rows;
+        editorJumpTo(n > 0 ? n - 1 : 0, 0);
+    }
+    free(input);
+}
+
+/** ======================== Undo ============================================ */
+/*
+ * Each edit is one record in editC.undo.buf:
+ *
+ *   type | text length | row delta | col | text | record size
+ *
+ * The lengths and col are varints and the row is stored as the difference
+ * from the row of the record before it, zigzag encoded, so a keystroke costs
+ * about 8 bytes and no allocation. The record size, 4 bytes at the end, lets
+ * undo walk the log backwards.
+ */
+#define UNDO_FOOTER ((int)sizeof(unsigned int))
+#define UNDO_COALESCE_MAX 64 //bytes typed on a row that are undone at once
+
+// A record of the log, decoded.
+struct undoRecord {
+    int type, flags;
+    int rowDelta;
+    long col;
+    const char *text;
+    size_t len;
+    size_t size; //of the whole record
 };
 
-#define BUFFER_INIT  {NULL, 0}
+size_t undoPutVarint(unsigned char *p, unsigned long v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+unsigned long undoGetVarint(const unsigned char **p) {
+    unsigned long v = 0;
+    int shift = 0;
+
+    while (**p & 0x80) {
+        v |= (unsigned long)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return v | (unsigned long)*(*p)++ << shift;
+}
 
 /**
- * This method appends a string s to an abuf, the first thing it does is to make sure
- * there is enough memory to hold the new string.
- * It calls realloc() to give us a block of memory that is the size of the current
- * string plus the size of the string being appended.
- * realloc() will either extend the size of the block of memory we already have
- * allocated, or it will take care of free()ing the current block of memory and
- * allocating a new block of memory somewhere else that is big enough for our new string.
- * Then we use memcpy() to copy the string s after the end of the current data in the
- * buffer, and we update the pointer and length of the abuf to the new values.
+ * Decodes the record starting at off.
  */
-void appendToBuffer(struct appendBuf *ab, const char *s, int len) {
-    char *new = realloc(ab->buf,ab->len + len);
+void undoDecode(size_t off, struct undoRecord *r) {
+    const unsigned char *start = editC.undo.buf + off, *p = start;
+    unsigned long z;
+
+    r->type = *p & U_TYPE;
+    r->flags = *p++ & ~U_TYPE;
+    r->len = undoGetVarint(&p);
+    z = undoGetVarint(&p);
+    r->rowDelta = (z & 1) ? ~(long)(z >> 1) : (long)(z >> 1);
+    r->col = undoGetVarint(&p);
+    r->text = (const char *)p;
+    r->size = p - start + r->len + UNDO_FOOTER;
+}
+
+/**
+ * Returns where the record ending at off starts.
+ */
+size_t undoPrev(size_t off) {
+    unsigned int size;
+
+    memcpy(&size, editC.undo.buf + off - UNDO_FOOTER, UNDO_FOOTER);
+    return off - size;
+}
+
+void replaceUndoFree(struct replaceUndo *ru) {
+    long i;
+
+    for (i = 0; i < ru->nrows; i++)
+        if (!(ru->rows[i].flags & ROW_BORROWED))
+            slabFree(&editC.slab, ru->rows[i].chars, ru->rows[i].size + 1);
+    free(ru->rows);
+    free(ru);
+}
+
+/**
+ * Frees what the record at off holds outside the log and returns its size.
+ */
+size_t undoRelease(size_t off) {
+    struct undoRecord r;
+    struct replaceUndo *ru;
+
+    undoDecode(off, &r);
+    if (r.type == U_REPLACE) {
+        memcpy(&ru, r.text, sizeof(ru));
+        editC.undo.extra -= ru->bytes;
+        replaceUndoFree(ru);
+    }
+    return r.size;
+}
+
+/**
+ * Drops the oldest records while the log is over its budget, down to 3/4 of
+ * it so that moving the rest is paid once in a while. The last record stays
+ * whatever its size, so the edit just made can always be undone.
+ */
+void undoTrim() {
+    struct undoLog *u = &editC.undo;
+    size_t off = 0, last;
+
+    if (u->len + u->extra <= u->budget || u->pos == 0) return;
+    last = undoPrev(u->pos);
+    while (off < last && u->len - off + u->extra > u->budget / 4 * 3)
+        off += undoRelease(off);
+    if (off == 0) return;
+    memmove(u->buf, u->buf + off, u->len - off);
+    u->len -= off;
+    u->pos -= off;
+}
+
+/**
+ * Appends a record; with U_CRLF in type, the \r\n and \r of text are stored
+ * as \n.
+ */
+void undoAppend(int type, int row, long col, const char *text, size_t len) {
+    struct undoLog *u = &editC.undo;
+    size_t n = len, i;
+    long d = (long)row - u->row;
+    unsigned char *p;
+    unsigned int size;
+
+    if (type & U_CRLF) {
+        for (i = 0; i + 1 < len; i++)
+            if (text[i] == '\r' && text[i + 1] == '\n') n--;
+    }
+    //type, three varints, the text and the size
+    if (u->len + 1 + 30 + n + UNDO_FOOTER > u->cap) {
+        u->cap = u->cap ? u->cap * 2 : 4096;
+        if (u->cap < u->len + 1 + 30 + n + UNDO_FOOTER) u->cap = u->len + 1 + 30 + n + UNDO_FOOTER;
+        u->buf = realloc(u->buf, u->cap);
+    }
+    p = u->buf + u->len;
+    *p++ = type & (U_TYPE | U_CONT);
+    p += undoPutVarint(p, n);
+    p += undoPutVarint(p, d < 0 ? ((unsigned long)~d << 1) | 1 : (unsigned long)d << 1);
+    p += undoPutVarint(p, col);
+    if (type & U_CRLF) {
+        for (i = 0; i < len; i++) {
+            if (text[i] != '\r') *p++ = text[i];
+            else if (i + 1 == len || text[i + 1] != '\n') *p++ = '\n';
+        }
+    } else if (len) {
+        memcpy(p, text, len);
+        p += len;
+    }
+    size = p + UNDO_FOOTER - (u->buf + u->len);
+    memcpy(p, &size, UNDO_FOOTER);
+    u->len += size;
+    u->pos = u->len;
+    u->row = row;
+}
+
+/**
+ * Records an edit about to be made at row, col, with the text it inserts or
+ * deletes. Anything undone before is dropped. A byte typed or deleted right
+ * next to the one before on the same row joins its record, up to
+ * UNDO_COALESCE_MAX bytes, so undo takes back a word rather than a letter.
+ */
+void undoPush(int type, int row, long col, const char *text, size_t len) {
+    struct undoLog *u = &editC.undo;
+    struct undoRecord top;
+    char merged[UNDO_COALESCE_MAX + 1];
+    size_t off;
+    int single = len == 1 && !(type & U_CONT) && text[0] != '\n';
+
+    if (u->applying) return;
+    for (off = u->pos; off < u->len; ) off += undoRelease(off);
+    u->len = u->pos;
+
+    if (single && u->coalesce) {
+        off = undoPrev(u->pos);
+        undoDecode(off, &top);
+        int k = type & U_TYPE;
+        if (k == top.type && row == u->row && top.len < UNDO_COALESCE_MAX &&
+            ((k == U_INSERT && col == top.col + (long)top.len) ||
+             (k == U_DELETE && (col == top.col || col + 1 == top.col)))) {
+            //rewrite the last record with the byte added
+            if (col + 1 == top.col && k == U_DELETE) {
+                merged[0] = text[0];
+                memcpy(merged + 1, top.text, top.len);
+            } else {
+                memcpy(merged, top.text, top.len);
+                merged[top.len] = text[0];
+                col = top.col;
+            }
+            type = k | top.flags;
+            text = merged;
+            len = top.len + 1;
+            u->row -= top.rowDelta;
+            u->len = u->pos = off;
+        }
+    }
+    undoAppend(type, row, col, text, len);
+    u->coalesce = single;
+    undoTrim();
+}
+
+/**
+ * Swaps the text of the rows a replace-all changed with the one kept in ru.
+ */
+void replaceUndoSwap(struct replaceUndo *ru) {
+    long i;
+
+    for (i = 0; i < ru->nrows; i++) {
+        struct replaceRow *rr = &ru->rows[i];
+        replaceSwap(editorRowEdit(rr->row), rr);
+    }
+    editC.dirtyFlag++;
+}
+
+/**
+ * Makes the edit of record r at row, or reverts it.
+ */
+void undoApply(const struct undoRecord *r, int row, int revert) {
+    struct replaceUndo *ru;
+
+    switch (r->type) {
+        case U_INSERT:
+        case U_DELETE:
+            if ((r->type == U_INSERT) != revert) {
+                editC.cy = row;
+                editC.cx = r->col;
+                editorInsertLines(r->text, r->len, 0);
+            } else {
+                editorDeleteText(row, r->col, r->len);
+            }
+            break;
+        case U_NEWROW:
+            if (revert) editorDelRow(row);
+            else editorInsertRow(row, "", 0);
+            editC.cy = row;
+            editC.cx = 0;
+            break;
+        case U_REPLACE:
+            memcpy(&ru, r->text, sizeof(ru));
+            replaceUndoSwap(ru);
+            editorSetStatusMsg("%s replace of %ld matches.", revert ? "Undid" : "Redid", ru->count);
+            break;
+    }
+}
+
+/**
+ * Keeps the cursor inside the text after an undo or redo.
+ */
+void undoClampCursor() {
+    if (editC.cy > editC.num_rows) editC.cy = editC.num_rows;
+    if (editC.cy == editC.num_rows) editC.cx = 0;
+    else if (editC.cx > editorRowAt(editC.cy)->size) editC.cx = editorRowAt(editC.cy)->size;
+}
+
+/**
+ * Undoes the last edit. Each record is reverted in what it costs to make, so
+ * undoing a paste or a replace-all takes as long as the edit did.
+ */
+void editorUndo() {
+    struct undoLog *u = &editC.undo;
+    struct undoRecord r;
+
+    if (u->pos == 0) {
+        editorSetStatusMsg("Nothing to undo.");
+        return;
+    }
+    u->applying = 1;
+    do {
+        size_t start = undoPrev(u->pos);
+        undoDecode(start, &r);
+        undoApply(&r, u->row, 1);
+        u->row -= r.rowDelta;
+        u->pos = start;
+    } while ((r.flags & U_CONT) && u->pos > 0);
+    u->applying = 0;
+    u->coalesce = 0;
+    undoClampCursor();
+}
+
+/**
+ * Redoes the last edit undone.
+ */
+void editorRedo() {
+    struct undoLog *u = &editC.undo;
+    struct undoRecord r;
+
+    if (u->pos == u->len) {
+        editorSetStatusMsg("Nothing to redo.");
+        return;
+    }
+    u->applying = 1;
+    do {
+        undoDecode(u->pos, &r);
+        u->row += r.rowDelta;
+        undoApply(&r, u->row, 0);
+        u->pos += r.size;
+    } while (u->pos < u->len && (u->buf[u->pos] & U_CONT));
+    u->applying = 0;
+    u->coalesce = 0;
+    undoClampCursor();
+}
+
+/** ======================== All write buffer handling goes here. ===================*/
 
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->buf = new;
+/**
+ * Makes room for len more bytes and returns where they go, or NULL if out of
+ * memory. The buffer doubles when it grows, so after the first few frames it
+ * is big enough and appending never allocates.
+ */
+char *bufferExtend(struct appendBuf *ab, int len) {
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 4096;
+        while (ab->len + len > cap) cap *= 2;
+        char *new = realloc(ab->buf, cap);
+        if (new == NULL) return NULL;
+        ab->buf = new;
+        ab->cap = cap;
+#ifdef SMEDITOR_DEBUG
+        ab->allocs++;
+#endif
+    }
+    char *p = &ab->buf[ab->len];
     ab->len += len;
+    return p;
+}
+
+/**
+ * This method appends a string s to an abuf. Room for it is made by
+ * bufferExtend(), then we use memcpy() to copy the string s after the end of
+ * the current data in the buffer.
+ */
+void appendToBuffer(struct appendBuf *ab, const char *s, int len) {
+    char *p = bufferExtend(ab, len);
+
+    if (p) memcpy(p, s, len);
+}
+
+/**
+ * Appends the byte c n times.
+ */
+void appendRepeat(struct appendBuf *ab, char c, int n) {
+    char *p = bufferExtend(ab, n);
+
+    if (p) memset(p, c, n);
+}
+
+/**
+ * Empties an abuf for the next frame but keeps its memory.
+ */
+void bufferReset(struct appendBuf *ab) {
+    ab->len = 0;
+}
+
+/**
+ * Writes the whole buffer to fd with as few write() calls as the terminal
+ * allows, picking up after short writes. Returns -1 on error.
+ */
+int bufferWrite(struct appendBuf *ab, int fd) {
+    int done = 0;
+
+    while (done < ab->len) {
+        ssize_t n = write(fd, ab->buf + done, ab->len - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * abFree() is a destructor that deallocates the dynamic memory used by an abuf.
+ */
+void bufferFree(struct appendBuf *ab) {
+  free(ab->buf);
+  ab->buf = NULL;
+  ab->len = ab->cap = 0;
+}
+
+/** ======================== Screen buffer ======================================== */
+/*
+ * The draw functions no longer write escape sequences directly. They fill
+ * the back buffer with the cells of the next frame, and screenFlush() only
+ * sends the cells that differ from the front buffer, i.e. from what the
+ * terminal currently shows.
+ */
+
+// Unchanged cells between two changed spans of a line that are cheaper to
+// resend than to skip with a cursor-positioning sequence.
+#define SCREEN_MERGE_GAP 6
+// Runs of one character at least this long are appended with appendRepeat().
+#define SCREEN_REPEAT_MIN 8
+
+/**
+ * Makes sure both buffers match the terminal size, and clears the back buffer
+ * for a new frame.
+ */
+void screenBegin(struct screenState *scr) {
+    int rows = editC.screen_rows + 2, cols = editC.screen_cols;
+    int i;
+
+    if (rows != scr->rows || cols != scr->cols) {
+        free(scr->front);
+        free(scr->back);
+        scr->rows = rows;
+        scr->cols = cols;
+        scr->front = malloc(sizeof(scell) * rows * cols);
+        scr->back = malloc(sizeof(scell) * rows * cols);
+        scr->frontValid = 0;
+    }
+    for (i = 0; i < rows * cols; i++) scr->back[i] = cellBlank;
+}
+
+/**
+ * Writes the len bytes of UTF-8 text s at row y, column x of the back buffer,
+ * clipped to the width of the screen.
+ */
+void screenPut(struct screenState *scr, int y, int x, const char *s, int len,
+               unsigned char attr) {
+    if (y < 0 || y >= scr->rows) return;
+    scell *cells = &scr->back[y * scr->cols];
+    int at = 0, from;
+
+    while (at < len && x < scr->cols) {
+        if ((unsigned char)s[at] < 0x80) {
+            cellSet(&cells[x++], s[at++], attr);
+            continue;
+        }
+        from = x;
+        at += utf8Draw(cells, &x, scr->cols, s, len, at);
+        for (; from < x; from++) cells[from].attr = attr;
+    }
+}
+
+/**
+ * Copies n rendered cells to row y, column x of the back buffer, clipped to
+ * the width of the screen. A wide character cut in half by either edge is
+ * drawn as a blank.
+ */
+void screenPutCells(struct screenState *scr, int y, int x, const scell *src, int n) {
+    if (y < 0 || y >= scr->rows) return;
+    scell *cells = &scr->back[y * scr->cols];
+    int cut = x + n > scr->cols;
+
+    if (cut) n = scr->cols - x;
+    if (n <= 0) return;
+    memcpy(&cells[x], src, sizeof(scell) * n);
+    if (cells[x].ch[0] == CELL_WIDE_TAIL) cells[x] = cellBlank;
+    if (cut && src[n].ch[0] == CELL_WIDE_TAIL) cells[x + n - 1] = cellBlank;
+}
+
+/**
+ * Sets the attribute of cells [x, end) of row y, e.g. to draw an inverted bar.
+ */
+void screenFill(struct screenState *scr, int y, int x, int end, unsigned char attr) {
+    for (; x < end && x < scr->cols; x++) scr->back[y * scr->cols + x].attr = attr;
+}
+
+/**
+ * Switches the terminal from the SGR attributes of one cell to those of
+ * another, sending only the ones that change.
+ */
+void screenSetAttr(struct appendBuf *ab, unsigned char from, unsigned char to) {
+    char buf[16];
+    int len = 2;
+
+    if (to == 0) {
+        appendToBuffer(ab, "\x1b[m", 3);
+        return;
+    }
+    memcpy(buf, "\x1b[", 2);
+    if ((from ^ to) & CELL_INVERSE)
+        len += sprintf(&buf[len], (to & CELL_INVERSE) ? "7" : "27");
+    if ((from ^ to) >> CELL_HL_SHIFT)
+        len += sprintf(&buf[len], "%s%d", len > 2 ? ";" : "",
+                       editorSyntaxToColor(to >> CELL_HL_SHIFT));
+    buf[len++] = 'm';
+    appendToBuffer(ab, buf, len);
+}
+
+void screenMoveTo(struct appendBuf *ab, int y, int x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    appendToBuffer(ab, buf, len);
+}
+
+/**
+ * When the text area moved by a few lines since the last frame, lets the
+ * terminal shift what it already shows: the text rows become the scroll
+ * region (DECSTBM) and are scrolled up (SU) or down (SD) by delta lines.
+ * The front buffer is shifted the same way, so screenFlush() then only
+ * draws the lines that scrolled into view.
+ */
+void screenScroll(struct screenState *scr, struct appendBuf *ab, int textRows, long delta) {
+    long n = delta > 0 ? delta : -delta;
+    char buf[32];
+    int y, x;
+
+    if (!scr->frontValid || delta == 0 || n >= textRows) return;
+
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%ld%c\x1b[r", textRows, n,
+                       delta > 0 ? 'S' : 'T');
+    appendToBuffer(ab, buf, len);
+
+    scell *front = scr->front;
+    int cols = scr->cols;
+    if (delta > 0) {
+        memmove(front, &front[n * cols], sizeof(scell) * (textRows - n) * cols);
+        y = textRows - n;
+    } else {
+        memmove(&front[n * cols], front, sizeof(scell) * (textRows - n) * cols);
+        y = 0;
+    }
+    //the lines scrolled in are blank
+    for (x = 0; x < n * cols; x++) front[y * cols + x] = cellBlank;
+}
+
+static inline int cellSame(const scell *a, const scell *b) {
+    return memcmp(a, b, sizeof(scell)) == 0;
+}
+
+/**
+ * Appends the characters of cells [from, to), which all have the same
+ * attribute. The second cell of a wide character adds nothing, as the
+ * terminal moves past it when it draws the first.
+ */
+int screenAppendCells(struct appendBuf *ab, const scell *cells, int from, int to) {
+    int room = sizeof(cells->ch) * (to - from), k;
+    char *p = bufferExtend(ab, room);
+
+    if (p == NULL) return -1;
+    char *start = p;
+    for (; from < to; from++) {
+        const char *ch = cells[from].ch;
+        if (ch[1] == '\0') {
+            if (ch[0] != CELL_WIDE_TAIL) *p++ = ch[0];
+            continue;
+        }
+        for (k = 0; k < (int)sizeof(cells->ch) && ch[k]; k++) *p++ = ch[k];
+    }
+    //room was made for the longest cells there can be
+    ab->len -= room - (p - start);
+    return 0;
 }
 
-/**
- * abFree() is a destructor that deallocates the dynamic memory used by an abuf.
- */
-void bufferFree(struct appendBuf *ab) {
-  free(ab->buf);
+/**
+ * Emits the difference between the back and the front buffer into ab, and
+ * makes the back buffer the new front buffer. Changed cells are sent in spans
+ * with one cursor move each, and a line that ends in blanks is cut short
+ * with <esc>[K. A span never starts or ends inside a wide character.
+ */
+void screenFlush(struct screenState *scr, struct appendBuf *ab) {
+    int y, x;
+    int cy = -1, cx = -1; //where the terminal cursor is, -1 if unknown
+    unsigned char attr = 0;
+
+    if (!scr->frontValid) {
+        //full redraw: start from a blank terminal and diff against that
+        appendToBuffer(ab, "\x1b[m\x1b[2J", 7);
+        for (x = 0; x < scr->rows * scr->cols; x++) scr->front[x] = cellBlank;
+        scr->frontValid = 1;
+    }
+
+    for (y = 0; y < scr->rows; y++) {
+        scell *back = &scr->back[y * scr->cols];
+        scell *front = &scr->front[y * scr->cols];
+        int blankFrom = scr->cols;
+
+        while (blankFrom > 0 && cellSame(&back[blankFrom - 1], &cellBlank))
+            blankFrom--;
+
+        x = 0;
+        while (x < scr->cols) {
+            if (cellSame(&back[x], &front[x])) {
+                x++;
+                continue;
+            }
+            //redraw a wide character whole: the one being drawn here, or the
+            //one the terminal shows that this cell overwrites half of
+            while (x > 0 && (back[x].ch[0] == CELL_WIDE_TAIL || front[x].ch[0] == CELL_WIDE_TAIL))
+                x--;
+            int end = x + 1, gap = 0, j;
+            for (j = x + 1; j < scr->cols && gap <= SCREEN_MERGE_GAP; j++) {
+                if (!cellSame(&back[j], &front[j])) {
+                    end = j + 1;
+                    gap = 0;
+                } else {
+                    gap++;
+                }
+            }
+            if (end < scr->cols && back[end].ch[0] == CELL_WIDE_TAIL) end++;
+
+            if (cy != y || cx != x) screenMoveTo(ab, y, x);
+            int stop = (end > blankFrom) ? blankFrom : end;
+            for (j = x; j < stop; ) {
+                if (back[j].attr != attr) {
+                    screenSetAttr(ab, attr, back[j].attr);
+                    attr = back[j].attr;
+                }
+                //copy the run of cells with this attribute in bulk, and long
+                //runs of one ASCII character, like the blanks of the status
+                //bar, as a repeated byte
+                int k = j, m, n;
+                while (k < stop && back[k].attr == attr) k++;
+                while (j < k) {
+                    for (m = j; m < k; m += n) {
+                        for (n = 1; m + n < k && cellSame(&back[m + n], &back[m]); n++);
+                        if (n >= SCREEN_REPEAT_MIN && back[m].ch[1] == '\0' &&
+                            back[m].ch[0] != CELL_WIDE_TAIL)
+                            break;
+                    }
+                    if (m > j) {
+                        if (screenAppendCells(ab, back, j, m) == -1) return;
+                        j = m;
+                    }
+                    if (j < k) {
+                        appendRepeat(ab, back[j].ch[0], n);
+                        j += n;
+                    }
+                }
+            }
+            cy = y;
+            cx = stop;
+            if (end > blankFrom) {
+                //the rest of the line is blank: erase it in one go
+                if (attr != 0) {
+                    screenSetAttr(ab, attr, 0);
+                    attr = 0;
+                }
+                appendToBuffer(ab, "\x1b[K", 3);
+                break;
+            }
+            if (cx >= scr->cols) cy = -1; //the cursor sits in the pending-wrap column
+            x = end;
+        }
+    }
+    if (attr != 0) screenSetAttr(ab, attr, 0);
+
+    scell *tmp = scr->front;
+    scr->front = scr->back;
+    scr->back = tmp;
 }
 
 /** ===================== All keyboard input handling functions. =====================*/
 
-char *editorPrompt(char *prompt) {
+/**
+ * Asks the user for a line of input in the message bar. If callback is not
+ * NULL it is called with the input and the key after every keypress. Enter
+ * only takes empty input if allowEmpty is set.
+ */
+char *editorPromptInput(char *prompt, void (*callback)(char *, int), int allowEmpty) {
     // user?s input is stored in buf which is dynamically allocated
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
     size_t buflen = 0;
     buf[0]='\0';
 
-    //enter an infinite loop that repeatedly sets the status message,
-    //refreshes the screen, and waits for a keypress to handle. The prompt is
+    //enter an infinite loop that repeatedly sets the status message
+    //and waits for a keypress to handle; the screen is redrawn meanwhile. The prompt is
     //expected to be a format string containing a %s, which is where the user's
     //input will be displayed.
     while(1) {
         editorSetStatusMsg(prompt, buf);
-        editorRefreshScreen();
 
         int c = editorReadKey();
         //When the user presses Enter, and their input is not empty,
@@ -630,17 +6511,38 @@ char *editorPrompt(char *prompt) {
         //Otherwise, when they input a printable character, we append it to buf.
         //allow the user to press Backspace (or Ctrl-H, or Delete) in the input prompt.
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0) buf[--buflen] = '\0';
+            //take out a whole UTF-8 sequence
+            if (buflen != 0) {
+                buflen = utf8Start(buf, buflen, buflen - 1);
+                buf[buflen] = '\0';
+            }
         } else if (c == '\x1b') {
             editorSetStatusMsg("");
+            if (callback) callback(buf, c);
             free(buf);
             return NULL;
         } else  if (c == '\r') {
-            if (buflen !=0) {
+            if (buflen !=0 || allowEmpty) {
                 editorSetStatusMsg("");
+                if (callback) callback(buf, c);
                 return buf;
             }
-        } else if (!iscntrl(c) && c <128) {
+        } else if (c == PASTE_KEY) {
+            //take the pasted text up to the first line break
+            size_t j;
+            for (j = 0; j < editC.paste.len; j++) {
+                char ch = editC.paste.buf[j];
+                if (ch == '\r' || ch == '\n') break;
+                if ((unsigned char)ch < 128 && iscntrl((unsigned char)ch)) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = ch;
+            }
+            buf[buflen] = '\0';
+        } else if (c < 256 && (c >= 128 || !iscntrl(c))) {
+            //bytes of 128 and up are parts of UTF-8 sequences
             // If buflen has reached the maximum capacity we allocated
             // (stored in bufsize), then we double bufsize and allocate that
             // amount of memory before appending to buf.
@@ -654,40 +6556,56 @@ char *editorPrompt(char *prompt) {
             buf[buflen++] = c;
             buf[buflen] = '\0';
         }
+        if (callback) callback(buf, c);
     }
 }
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    return editorPromptInput(prompt, callback, 0);
+}
+
 void editorMoveCursor(int key) {
     // check if the cursor is on an actual line. If it is, then the row
     // variable will point to the erow that the cursor is on, and we?ll
     // check whether E.cx is to the left of the end of that line before we
     // allow the cursor to move to the right.
-    erow *row = (editC.cy >= editC.num_rows) ? NULL : &editC.row[editC.cy];
+    erow *row = (editC.cy >= editC.num_rows) ? NULL : editorRowAt(editC.cy);
+    //up and down keep the screen column, not the byte offset
+    long rx = row ? editorRowCxToRx(row, editC.cx) : 0;
 
     switch(key) {//the if checks prevent the cursor from going off the screen
         case ARROW_LEFT:
-            if (editC.cx != 0) {
-                editC.cx--;  //move left
+            if (row && editC.cx != 0) {
+                editC.cx = editorRowPrevChar(row, editC.cx);  //move left
             } else if (editC.cy > 0){
                 //allow user to move to the end of  the previous line
                 editC.cy--;
-                editC.cx = editC.row[editC.cy].size;
+                editC.cx = editorRowAt(editC.cy)->size;
             }
             break;
         case ARROW_RIGHT:
             //Allow moving right at the end of a line
             if (row  && editC.cx < row->size) {
-                editC.cx++;  //move right
+                editC.cx = editorRowNextChar(row, editC.cx);  //move right
             }else if(row && editC.cx == row->size) {
                editC.cy++;
                 editC.cx = 0;
             }
             break;
         case ARROW_UP:
+            //with soft wrap on, up and down go by visual lines
+            if (editC.wrap.on) {
+                wrapMoveCursor(-1);
+                return;
+            }
             if(editC.cy != 0) {
                 editC.cy--; //move up
             }
             break;
         case ARROW_DOWN:
+            if (editC.wrap.on) {
+                wrapMoveCursor(1);
+                return;
+            }
             if(editC.cy <  editC.num_rows) {
                 editC.cy++; //move right
             }
@@ -696,13 +6614,30 @@ void editorMoveCursor(int key) {
     // set row again, since E.cy could point to a different line than it did before.
     // We then set E.cx to the end of that line if E.cx is to the right of the end
     // of that line. Also note that we consider a NULL line to be of length 0,
-    row = (editC.cy >= editC.num_rows) ? NULL : &editC.row[editC.cy];
-    int rowlen = row ? row->size : 0;
-    if(editC.cx > rowlen){
+    row = (editC.cy >= editC.num_rows) ? NULL : editorRowAt(editC.cy);
+    long rowlen = row ? row->size : 0;
+    if ((key == ARROW_UP || key == ARROW_DOWN) && row) {
+        editC.cx = editorRowRxToCx(row, rx);
+    } else if(editC.cx > rowlen){
         editC.cx = rowlen;
     }
 }
 
+/**
+ * Moves the cursor n rows down, or up if n is negative, in one step, keeping
+ * its screen column as editorMoveCursor() does for one row.
+ */
+void editorMoveRows(int n) {
+    erow *row = (editC.cy >= editC.num_rows) ? NULL : editorRowAt(editC.cy);
+    long rx = row ? editorRowCxToRx(row, editC.cx) : 0;
+
+    if (n < -editC.cy) n = -editC.cy;
+    if (n > editC.num_rows - editC.cy) n = editC.num_rows - editC.cy;
+    editC.cy += n;
+    row = (editC.cy >= editC.num_rows) ? NULL : editorRowAt(editC.cy);
+    editC.cx = row ? editorRowRxToCx(row, rx) : 0;
+}
+
 /**
  * Main handler for all key press events
  *
@@ -719,6 +6654,8 @@ void editorProcessKeypress() {
                 quitTimes--;
                 return;
             }
+            //let a running save finish, or the file would not be written
+            editorSaveWait();
             //Clear screen before exit
             write(STDOUT_FILENO, "\x1b[2J",4); //J command erases everything in display
             write(STDOUT_FILENO, "\x1b[H", 3); //Repositions the cursor to the first row and col
@@ -733,11 +6670,10 @@ void editorProcessKeypress() {
             break;
         case PAGE_UP:
         case PAGE_DOWN:
-            {
-                int times = editC.screen_rows;
-                while(times--) {
-                    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-                }
+            if (editC.wrap.on) {
+                wrapMoveCursor(c == PAGE_UP ? -editC.screen_rows : editC.screen_rows);
+            } else {
+                editorMoveRows(c == PAGE_UP ? -editC.screen_rows : editC.screen_rows);
             }
             break;
         case ARROW_UP:
@@ -750,18 +6686,46 @@ void editorProcessKeypress() {
             editC.cx = 0; //move cursor to start position
             break;
         case END_KEY:
-            editC.cx = editC.screen_cols - 1;
+            //the end of the line, not of the screen, so the cursor never
+            //lands inside a character
+            if (editC.cy < editC.num_rows) editC.cx = editorRowAt(editC.cy)->size;
             break;
         case BACKSPACE:
         case CTRL_KEY('h'):
+            editorDelChar();
+            break;
         case CTRL_KEY('f'):
             editorFind();
             break;
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+        case PASTE_KEY:
+            editorInsertText(editC.paste.buf, editC.paste.len);
+            break;
         case DEL_KEY:
             /** TODO */
             if(c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
             editorDelChar();
+            break;
+        case CTRL_KEY('g'):
+            editorGoTo();
+            break;
+        case CTRL_KEY('w'):
+            editC.wrap.on = !editC.wrap.on;
+            editC.wrap.seg = 0;
+            editorSetStatusMsg("Soft wrap %s", editC.wrap.on ? "on" : "off");
+            break;
         case CTRL_KEY('l'):
+            //redraw the whole screen, e.g. after another program wrote to it
+            editC.screen.frontValid = 0;
+            break;
         case '\x1b':
             break;
         default:
@@ -772,11 +6736,43 @@ void editorProcessKeypress() {
 }
 
 /**  Editor output functions. *******************************************/
+
+/**
+ * editorScroll() with soft wrap on: scrolls by visual lines so the line of
+ * the cursor is on screen, and shows the line the cursor is on from its
+ * first column. The distance from the top of the screen to the cursor is read
+ * from the layout tree; if laying out a block on the way moved either of
+ * them, it is worked out again.
+ */
+void editorScrollWrap() {
+    int cols = editC.screen_cols, lines, cy;
+    long cur, top, seg;
+
+    do {
+        cur = wrapLineOf(editC.cy, cols, &lines);
+        seg = wrapCursorSeg(lines, cols);
+        cur += seg;
+        top = wrapLineOf(editC.rowoffset, cols, &lines);
+        top += editC.wrap.seg < lines ? editC.wrap.seg : lines - 1;
+        if (cur < top) top = cur;
+        if (cur >= top + editC.screen_rows) top = cur - editC.screen_rows + 1;
+        editC.rowoffset = wrapLocate(top, cols, &editC.wrap.seg);
+        cy = wrapLineOf(editC.cy, cols, NULL);
+    } while (cy + seg != cur || wrapLineOf(editC.rowoffset, cols, NULL) + editC.wrap.seg != top);
+    editC.wrap.top = top;
+    editC.wrap.line = cur;
+    editC.coloffset = seg * cols;
+}
+
 void editorScroll() {
 
     editC.rx = 0;
     if(editC.cy < editC.num_rows) {
-        editC.rx = editorRowCxToRx(&editC.row[editC.cy],editC.cx);
+        editC.rx = editorRowCxToRx(editorRowAt(editC.cy),editC.cx);
+    }
+    if (editC.wrap.on) {
+        editorScrollWrap();
+        return;
     }
     if (editC.cy < editC.rowoffset) {
         editC.rowoffset = editC.cy;
@@ -792,13 +6788,43 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct appendBuf *ab) {
-    int i;
+/**
+ * Colors the len cells of screen row y that show row from render column from
+ * on, from its highlight. Only the chars on screen are looked at.
+ */
+void editorDrawHighlight(struct screenState *scr, int y, erow *row, long from, int len) {
+    struct rowExtra *ex = rowExtraGet(row);
+    const char *chars = rowChars(row);
+    long j, rx, next, end = from + len;
+
+    if (!ex->hl) {
+        ex->hlSize = row->size + 1;
+        ex->hl = slabAlloc(&editC.slab, ex->hlSize);
+        syntaxLex(editC.syntax.lang, chars, row->size, row->hlStart, ex->hl);
+    }
+    //start from the char at the left edge of the screen
+    j = editorRowRxToCx(row, from);
+    rx = editorRowCxToRx(row, j);
+    for (; j < row->size && rx < end; j++, rx = next) {
+        //the bytes after the first of a character take no columns
+        next = rowWalkRx(row, j, j + 1, rx);
+        if (ex->hl[j] == HL_NORMAL || next <= from) continue;
+        screenFill(scr, y, (rx > from ? rx : from) - from,
+                   (next < end ? next : end) - from, ex->hl[j] << CELL_HL_SHIFT);
+    }
+}
+
+void editorDrawRows(struct screenState *scr) {
+    int i, filerow = editC.rowoffset, lines = 1;
+    //with soft wrap on, a row takes lines screen rows, from line seg of it
+    long seg = editC.wrap.on ? editC.wrap.seg : 0;
+    //the rows on screen need the state of every row above them
+    editorSyntaxUpdate(editC.rowoffset + editC.screen_rows - 1);
     for (i=0; i<editC.screen_rows; i++){
-        int filerow = i + editC.rowoffset;
         if (filerow  >= editC.num_rows ) {
+            screenPut(scr, i, 0, "~", 1, 0);
             //Display welcome message only of no file to open
-            if(editC.num_rows ==0 && i == editC.screen_rows / 3) {
+            if(editC.num_rows ==0 && !editorLoading() && i == editC.screen_rows / 3) {
                 char welcomeMessage[80];
 
                 int welcomeLen = snprintf(welcomeMessage, sizeof(welcomeMessage),
@@ -807,65 +6833,89 @@ void editorDrawRows(struct appendBuf *ab) {
                 if(welcomeLen > editC.screen_cols)
                     welcomeLen = editC.screen_cols;
 
-                //Center the welcome message on the screeni
-                int padding = (editC.screen_cols - welcomeLen / 2);
-
-                if(padding) {
-                    appendToBuffer(ab,"~",1);
-                    padding--;
-                }
-                while(padding--) appendToBuffer(ab," ",1);
-                appendToBuffer(ab,welcomeMessage,welcomeLen);
-            } else {
-                appendToBuffer(ab, "~", 1);
+                //Center the welcome message on the screen
+                int padding = (editC.screen_cols - welcomeLen) / 2;
+                if (padding < 1) padding = 1;
+                screenPut(scr, i, padding, welcomeMessage, welcomeLen, 0);
             }
         } else {
-            int len = editC.row[filerow].rsize - editC.coloffset;
-            if (len < 0) len =0; //prevents len from being negative
+            erow *row = editorRowAt(filerow);
+            long from = editC.coloffset;
+            int len;
+            if (editC.wrap.on) {
+                if (i == 0 || seg == 0)
+                    lines = wrapLines(editorRowCxToRx(row, row->size), editC.screen_cols);
+                if (seg >= lines) seg = lines - 1;
+                from = seg * editC.screen_cols;
+            }
+            scell *render = editorRowRender(row, from, editC.screen_cols, &len);
+            screenPutCells(scr, i, 0, render, len);
             if(len > editC.screen_cols) len = editC.screen_cols;
-            appendToBuffer(ab,&editC.row[filerow].render[editC.coloffset], len);
+            if (editC.syntax.lang) editorDrawHighlight(scr, i, row, from, len);
          }
-        //put a <esc>[K sequence at the end of each line we draw
-        appendToBuffer(ab,"\x1b[K",3);
-        //Draw a status bar
-        //if (i <  editC.screen_rows - 1) {
-        appendToBuffer(ab, "\r\n", 2);
-        //}
+        if (++seg >= lines) {
+            filerow++;
+            seg = 0;
+        }
     }
 }
 
 /**
  * Draw a status bar at the bottom of the screen editor
  */
-void editorDrawStatusbar(struct appendBuf *ab) {
-    //Use the 'm' command to causes the text printed after it to be
-    //printed with various possible attributes including
-    //bold (1), underscore (4), blink (5), and inverted colors (7).
-    //E.g. specify all of these attributes using the command <esc>[1;4;5;7m.
-    //An argument of 0 clears all attributes, and is the default argument,
-    //so we use <esc>[m to go back to normal text formatting.
-    appendToBuffer(ab, "\x1b[7m", 4);
+void editorDrawStatusbar(struct screenState *scr) {
+    //The bar is drawn with inverted colors; screenFlush() turns CELL_INVERSE
+    //into the 'm' command with an argument of 7, and back to normal text
+    //formatting with <esc>[m.
+    int y = editC.screen_rows;
     char status[80], rstatus[80];
 
-    int len = snprintf(status,sizeof(status), "%.20s - %d lines %s",
+    char loading[32] = "";
+    if (editorLoading()) {
+        int pct = editorLoadPercent();
+        if (pct >= 0) snprintf(loading, sizeof(loading), " loading %d%%", pct);
+        else snprintf(loading, sizeof(loading), " loading...");
+    } else if (editorSaving()) {
+        double mbps;
+        int pct = editorSavePercent(&mbps);
+        snprintf(loading, sizeof(loading), " saving %d%% %.0f MB/s", pct, mbps);
+    }
+    int len = snprintf(status,sizeof(status), "%.20s - %d lines%s %s",
                         editC.filename ? editC.filename :  "[NO NAME]", editC.num_rows,
-                        editC.dirtyFlag ? "(file modified)" : "Unchanged");
-    //show the current line number
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", editC.cy + 1, editC.num_rows);
+                        loading, editC.dirtyFlag ? "(file modified)" : "Unchanged");
+    //show the current line number and byte offset, and the size of the last
+    //frame if asked to
+    char pos[48];
+    long offset = storeRowOffset(&editC.text, editC.cy) + (editC.cy < editC.num_rows ? editC.cx : 0);
+    snprintf(pos, sizeof(pos), "%d/%d @%ld", editC.cy + 1, editC.num_rows, offset);
+    int rlen;
+    if (editC.find.active && editC.find.error) {
+        rlen = snprintf(rstatus, sizeof(rstatus), "regex: %s  %s", editC.find.error, pos);
+    } else if (editC.find.active && editC.find.qlen) {
+        //while the workers are counting, the total is a lower bound
+        char current[24] = "?";
+        if (editC.find.current) snprintf(current, sizeof(current), "%ld", editC.find.current);
+        rlen = snprintf(rstatus, sizeof(rstatus), "%smatch %s/%ld%s  %s",
+                        editC.find.regex ? "regex " : "", current,
+                        editC.find.total, editC.findJob.running ? "+" : "", pos);
+    } else if (editC.showStats)
+#ifdef SMEDITOR_DEBUG
+        rlen = snprintf(rstatus, sizeof(rstatus), "%zu B/frame %u allocs  %s",
+                        editC.screen.frameBytes, editC.screen.frameAllocs, pos);
+#else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%zu B/frame  %s",
+                        editC.screen.frameBytes, pos);
+#endif
+    else if (editC.syntax.lang)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %s", editC.syntax.lang->filetype, pos);
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s", pos);
     if(len > editC.screen_cols) len = editC.screen_cols;
-    appendToBuffer(ab, status, len);
 
-    while(len < editC.screen_cols) {
-        if(editC.screen_cols - len == rlen) {
-            appendToBuffer(ab, rstatus, rlen);
-            break;
-        } else {
-            appendToBuffer(ab, " ",1);
-            len++;
-        }
-    }
-    appendToBuffer(ab, "\x1b[m ", 3);
-    appendToBuffer(ab, "\r\n ", 2);
+    screenFill(scr, y, 0, editC.screen_cols, CELL_INVERSE);
+    screenPut(scr, y, 0, status, len, CELL_INVERSE);
+    if (editC.screen_cols - len >= rlen)
+        screenPut(scr, y, editC.screen_cols - rlen, rstatus, rlen, CELL_INVERSE);
 }
 
 /**
@@ -878,18 +6928,16 @@ void editorSetStatusMsg(const char *fmt, ...) {
     vsnprintf(editC.statusMesg, sizeof(editC.statusMesg), fmt, ap);
     va_end(ap);
     editC.status_time = time(NULL);
+    editC.events.redraw = 1;
 }
 /**
  *Draws status bar message.
  *
  */
-void editorDrawMsgBar(struct appendBuf *ab) {
-    //Clear the message bar
-    appendToBuffer(ab, "\x1b[K", 3);
+void editorDrawMsgBar(struct screenState *scr) {
     int len =  strlen(editC.statusMesg);
-    if (len > editC.screen_cols) len = editC.screen_cols;
-    if (len && (time(NULL) - editC.status_time) < 5)
-        appendToBuffer(ab, editC.statusMesg, len);
+    if (len && (time(NULL) - editC.status_time) < SMEDITOR_STATUS_SECS)
+        screenPut(scr, editC.screen_rows + 1, 0, editC.statusMesg, len, 0);
 }
 /**
  * In order to clear the screen, we are writing an escape sequence to the terminal.
@@ -897,35 +6945,188 @@ void editorDrawMsgBar(struct appendBuf *ab) {
  * Escape sequences instruct the terminal to do various text formatting tasks, such as
  * coloring text, moving the cursor around, and clearing parts of the screen.
  *
- * In editorRefreshScreen(), we first initialize a new abuf called ab, by assigning
- * BUFFER_INIT to it. We then replace each occurrence of write(STDOUT_FILENO, ...)
- * with abAppend(&ab, ...). We also pass ab into editorDrawRows(), so it too can
- * use abAppend(). Lastly, we write() the buffer’s contents out to standard output
- * and free the memory used by the abuf
+ * In editorRefreshScreen(), the draw functions fill the back buffer of the
+ * screen, and screenFlush() appends only the cells that changed since the last
+ * frame to an abuf. Lastly, we write() the buffer’s contents out to standard
+ * output and free the memory used by the abuf.
+ * A full redraw only happens on the first frame, on resize, or after Ctrl-L.
  */
 void editorRefreshScreen() {
+    editorLoaderPoll();
     editorScroll();
-    struct appendBuf ab = BUFFER_INIT;
+    struct appendBuf *ab = &editC.screen.out;
 
-    appendToBuffer(&ab, "\x1b[?25l",6); //Hides the cursor
-    //appendToBuffer(&ab, "\x1b[2J",4); //J command erases everything in display
-    appendToBuffer(&ab, "\x1b[H", 3); //Repositions the cursor to the first row and col
+    bufferReset(ab);
+#ifdef SMEDITOR_DEBUG
+    unsigned allocs = ab->allocs;
+#endif
+    screenBegin(&editC.screen);
+    editorDrawRows(&editC.screen);
+    editorDrawStatusbar(&editC.screen);
+    editorDrawMsgBar(&editC.screen);
 
-    editorDrawRows(&ab);
-    editorDrawStatusbar(&ab);
-    editorDrawMsgBar(&ab);
+    //With synchronized output the terminal shows the frame only once all of
+    //it has arrived, so there is no tearing on slow links
+    if (editC.screen.syncOutput) appendToBuffer(ab, "\x1b[?2026h", 8);
+    appendToBuffer(ab, "\x1b[?25l",6); //Hides the cursor
+    //with soft wrap on the screen moves by visual lines, never sideways
+    long top = editC.wrap.on ? editC.wrap.top : editC.rowoffset;
+    long left = editC.wrap.on ? -1 : editC.coloffset;
+    if (left == editC.screen.coloffset)
+        screenScroll(&editC.screen, ab, editC.screen_rows, top - editC.screen.top);
+    editC.screen.top = top;
+    editC.screen.coloffset = left;
+    screenFlush(&editC.screen, ab);
 
-    char buf[32];
-    snprintf(buf,sizeof(buf),"\x1b[%d;%dH",(editC.cy - editC.rowoffset) + 1,
-                                           (editC.rx - editC.coloffset) + 1);
-    appendToBuffer(&ab,buf,strlen(buf));
+    char buf[48];
+    long x = editC.rx - editC.coloffset;
+    if (x >= editC.screen_cols) x = editC.screen_cols - 1;
+    snprintf(buf,sizeof(buf),"\x1b[%ld;%ldH",
+             (editC.wrap.on ? editC.wrap.line : editC.cy) - top + 1, x + 1);
+    appendToBuffer(ab,buf,strlen(buf));
+
+    appendToBuffer(ab, "\x1b[?25h",6); //Shows the cursor again
+    if (editC.screen.syncOutput) appendToBuffer(ab, "\x1b[?2026l", 8);
+
+    bufferWrite(ab, STDOUT_FILENO);
+    editC.screen.frameBytes = ab->len;
+    editC.screen.totalBytes += ab->len;
+    editC.screen.frames++;
+#ifdef SMEDITOR_DEBUG
+    editC.screen.frameAllocs = ab->allocs - allocs;
+#endif
+    renderCacheTrim(&editC.rcache);
+}
+
+/** ========================== Event loop =============================== */
+
+/**
+ * Wakes up the event loop. Safe to call from signal handlers and from other
+ * threads; the byte itself carries no meaning.
+ */
+void editorWake() {
+    if (editC.events.wake[1] != -1) write(editC.events.wake[1], "", 1);
+}
+
+void handleSigwinch(int sig) {
+    int savedErrno = errno;
+
+    (void)sig;
+    editC.events.winch = 1;
+    editorWake();
+    errno = savedErrno;
+}
+
+/**
+ * Sets up the self-pipe and the SIGWINCH handler. SMEDITOR_FPS caps how
+ * often the screen is redrawn; 0 draws after every batch of input.
+ */
+void editorInitEvents() {
+    struct sigaction sa;
+    const char *fps = getenv("SMEDITOR_FPS");
+    int i;
+
+    if (pipe(editC.events.wake) == -1) handleError("[SMEditor]: Could not create pipe.");
+    for (i = 0; i < 2; i++) {
+        fcntl(editC.events.wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(editC.events.wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+
+    i = fps ? atoi(fps) : SMEDITOR_FPS;
+    editC.events.frameMs = (i > 0) ? 1000 / i : 0;
+    editC.events.lastFrame = 0;
+    editC.events.redraw = 1;
+}
+
+/**
+ * Lays the editor out again for the new size of the terminal. The screen
+ * buffers follow in screenBegin(), which also forces a full redraw.
+ */
+void editorResize() {
+    int rows, cols;
+
+    if (getWindowSize(&rows, &cols) == -1) return;
+    editC.screen_rows = rows - 2;
+    editC.screen_cols = cols;
+    if (editC.screen_rows < 1) editC.screen_rows = 1;
+    renderCacheResize(&editC.rcache, editC.screen_rows * 4);
+    editC.events.redraw = 1;
+}
+
+/**
+ * Milliseconds until the status message expires, or -1 if none is shown.
+ * An expired message is cleared and a redraw scheduled to take it down.
+ */
+long editorStatusTimer() {
+    struct timespec ts;
+    long left;
+
+    if (!editC.statusMesg[0]) return -1;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    left = (editC.status_time + SMEDITOR_STATUS_SECS - ts.tv_sec) * 1000 -
+           ts.tv_nsec / 1000000;
+    if (left > 0) return left;
+    editC.statusMesg[0] = '\0';
+    editC.events.redraw = 1;
+    return -1;
+}
 
+/**
+ * The event loop. Blocks in poll() on the terminal and the self-pipe until
+ * there is input to decode, and meanwhile handles resizes, loader progress
+ * and timers. The screen is only drawn once all input that arrived has been
+ * handled, and at most once per frameMs, so bursts of keys, pastes and loader
+ * updates are coalesced into a single frame.
+ */
+void editorWaitEvent() {
+    struct pollfd pfd[2];
 
-    //appendToBuffer(&ab, "\x1b[H", 3); //Repositions the cursor to the first row and col
-    appendToBuffer(&ab, "\x1b[?25h",6); //Hides the cursor
+    while (!editorInputPending()) {
+        long now = loaderMillis(), timeout = editorStatusTimer();
+
+        if (editC.events.winch) {
+            editC.events.winch = 0;
+            editorResize();
+        }
+        if (editorSaving()) {
+            //keep the progress of the save in the status bar moving
+            long due = editC.events.lastFrame + SAVE_PROGRESS_MS;
+            if (now >= due) editC.events.redraw = 1;
+            else if (timeout == -1 || due - now < timeout) timeout = due - now;
+        }
+        if (editC.events.redraw) {
+            long due = editC.events.lastFrame + editC.events.frameMs;
+            if (now >= due) {
+                editC.events.redraw = 0;
+                editC.events.lastFrame = now;
+                editorRefreshScreen();
+                continue;
+            }
+            if (timeout == -1 || due - now < timeout) timeout = due - now;
+        }
 
-    write(STDOUT_FILENO,ab.buf, ab.len);
-    bufferFree(&ab);
+        pfd[0].fd = STDIN_FILENO;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = editC.events.wake[0];
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, (int)timeout) == -1) {
+            if (errno == EINTR) continue;
+            handleError("SMEDITOR: poll");
+        }
+        if (pfd[1].revents & POLLIN) {
+            char drain[64];
+            while (read(editC.events.wake[0], drain, sizeof(drain)) > 0);
+            if (editorLoaderPoll()) editC.events.redraw = 1;
+            if (editorSavePoll()) editC.events.redraw = 1;
+            if (editorFindPoll()) editC.events.redraw = 1;
+        }
+        if (pfd[0].revents) inputFill();
+    }
 }
 
 /** Editor init. */
@@ -935,13 +7136,29 @@ void initEditor() {
     editC.cy = 0;
     editC.rx = 0;
     editC.num_rows = 0;
-    editC.row = NULL;
+    memset(&editC.text, 0, sizeof(editC.text));
+    memset(&editC.mapped, 0, sizeof(editC.mapped));
+    editC.mapped.fd = -1;
+    memset(&editC.loader, 0, sizeof(editC.loader));
+    editC.loader.fd = -1;
+    memset(&editC.rcache, 0, sizeof(editC.rcache));
+    memset(&editC.screen, 0, sizeof(editC.screen));
+    memset(&editC.events, 0, sizeof(editC.events));
+    editC.events.wake[0] = editC.events.wake[1] = -1;
+    //SMEDITOR_STATS=1 shows how many bytes each frame sent to the terminal
+    editC.showStats = getenv("SMEDITOR_STATS") != NULL;
     editC.rowoffset = 0;
     editC.coloffset = 0;
     editC.filename = NULL;
     editC.statusMesg[0] = '\0';
     editC.status_time = 0;
     editC.dirtyFlag = 0;
+    editC.syntax.lang = NULL;
+    editC.syntax.valid = 0;
+    memset(&editC.undo, 0, sizeof(editC.undo));
+    //SMEDITOR_UNDO_MB caps the memory kept to undo edits
+    const char *undoMb = getenv("SMEDITOR_UNDO_MB");
+    editC.undo.budget = (size_t)(undoMb && atoi(undoMb) > 0 ? atoi(undoMb) : SMEDITOR_UNDO_MB) << 20;
 
     if (getWindowSize(&editC.screen_rows, &editC.screen_cols) == -1) {
         handleError("Unable to get window size.");
@@ -949,20 +7166,723 @@ void initEditor() {
     //decrement number of rows available to editor in order to make room for status bar
     //make room for status message as well so we need 2 rows
     editC.screen_rows -= 2;
+    editC.screen.syncOutput = getSyncOutputSupport();
+    editorInitEvents();
+}
+
+#ifdef SMEDITOR_BENCH
+#include<malloc.h>
+#include<locale.h>
+#include<wchar.h>
+/* =============================== Benchmarks ============================*/
+/*
+ * Built with `make bench`. Each benchmark runs a few times over the given file
+ * and reports the best throughput, so the numbers measure the code and not a
+ * cold page cache.
+ */
+#define BENCH_RUNS 5
+
+double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void benchReport(const char *name, size_t bytes, double secs, size_t count,
+                 const char *unit) {
+    printf("%-22s %8.2f GB/s  %10.1f ms  %zu %s\n", name,
+           bytes / secs / 1e9, secs * 1e3, count, unit);
+}
+
+/**
+ * Splits the file into lines with the getline() loop editorOpen used to have,
+ * against each newline scanner and the threaded index builder.
+ */
+void benchScan(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) handleError("bench: mmap");
+
+    struct {
+        const char *name;
+        newlineScanner scan;
+    } scanners[] = {
+        {"scalar (memchr)", scanNewlinesScalar},
+#if defined(__x86_64__) || defined(__i386__)
+        {"sse2", scanNewlinesSSE2},
+        {"avx2", __builtin_cpu_supports("avx2") ? scanNewlinesAVX2 : NULL},
+#endif
+    };
+    double best, t;
+    size_t lines = 0;
+    int run;
+    unsigned i;
+
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        FILE *fp = fopen(path, "r");
+        char *line = NULL;
+        size_t lineCap = 0;
+        ssize_t lineLen;
+        lines = 0;
+        t = benchNow();
+        while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
+            while (lineLen > 0 && (line[lineLen - 1] == '\n' || line[lineLen - 1] == '\r'))
+                lineLen--;
+            lines++;
+        }
+        t = benchNow() - t;
+        if (t < best) best = t;
+        free(line);
+        fclose(fp);
+    }
+    benchReport("getline loop", size, best, lines, "lines");
+
+    for (i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+        if (!scanners[i].scan) continue;
+        best = 1e9;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            struct lineIndex li;
+            memset(&li, 0, sizeof(li));
+            t = benchNow();
+            lineIndexReserve(&li, 1);
+            li.off[li.n++] = 0;
+            scanners[i].scan(map, 0, size, size, &li);
+            t = benchNow() - t;
+            if (t < best) best = t;
+            lines = li.n;
+            free(li.off);
+        }
+        benchReport(scanners[i].name, size, best, lines, "lines");
+    }
+
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        int crlf;
+        t = benchNow();
+        size_t *off = editorIndexLines(map, size, &lines, &crlf);
+        t = benchNow() - t;
+        if (t < best) best = t;
+        free(off);
+    }
+    benchReport("editorIndexLines", size, best, lines, "lines");
+
+    munmap(map, size);
+    close(fd);
+}
+
+/**
+ * Counts the matches of needle in the file line by line with strstr(), as
+ * editorFind used to, against each searcher run over the whole text.
+ */
+void benchSearch(const char *path, const char *needle) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size, qlen = strlen(needle);
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) handleError("bench: mmap");
+
+    struct {
+        const char *name;
+        textSearcher search;
+    } searchers[] = {
+        {"search scalar", searchTextScalar},
+#if defined(__x86_64__) || defined(__i386__)
+        {"search sse2", searchTextSSE2},
+        {"search avx2", __builtin_cpu_supports("avx2") ? searchTextAVX2 : NULL},
+#endif
+        {"search memmem", (textSearcher)memmem},
+    };
+    double best, t;
+    size_t matches = 0;
+    int run;
+    unsigned i;
+
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        FILE *fp = fopen(path, "r");
+        char *line = NULL;
+        size_t lineCap = 0;
+        matches = 0;
+        t = benchNow();
+        while (getline(&line, &lineCap, fp) != -1) {
+            char *p = line;
+            while ((p = strstr(p, needle)) != NULL) {
+                matches++;
+                p++;
+            }
+        }
+        t = benchNow() - t;
+        if (t < best) best = t;
+        free(line);
+        fclose(fp);
+    }
+    benchReport("strstr per line", size, best, matches, "matches");
+
+    for (i = 0; i < sizeof(searchers) / sizeof(searchers[0]); i++) {
+        if (!searchers[i].search) continue;
+        best = 1e9;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            const char *p = map, *end = map + size;
+            matches = 0;
+            t = benchNow();
+            while ((p = searchers[i].search(p, end - p, needle, qlen)) != NULL) {
+                matches++;
+                p++;
+            }
+            t = benchNow() - t;
+            if (t < best) best = t;
+        }
+        benchReport(searchers[i].name, size, best, matches, "matches");
+    }
+
+    munmap(map, size);
+    close(fd);
+}
+
+/**
+ * Finds the lines matching pattern with POSIX regexec(), line by line, against
+ * the lazy DFA: row by row over the same lines, and block by block with the
+ * literal prefilter as the search does.
+ */
+void benchRegex(const char *path, const char *pattern) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size, nlines, i;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) handleError("bench: mmap");
+
+    const char *err;
+    regex_t posix;
+    struct searchQuery sq;
+    memset(&sq, 0, sizeof(sq));
+    sq.re = regexCompile(pattern, &err);
+    if (sq.re == NULL || regcomp(&posix, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        fprintf(stderr, "bench: bad regex %s\n", pattern);
+        exit(1);
+    }
+    sq.lit = sq.re->lit;
+    sq.litlen = sq.re->litlen;
+    sq.dfa = regexDfaNew(sq.re, 0);
+
+    int crlf, run;
+    long first, last;
+    size_t *off = editorIndexLines(map, size, &nlines, &crlf);
+    struct textStore ts;
+    memset(&ts, 0, sizeof(ts));
+    storeAppendLazy(&ts, map, off, nlines, size);
+    double best, t;
+    size_t count = 0;
+
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        FILE *fp = fopen(path, "r");
+        char *line = NULL;
+        size_t lineCap = 0;
+        ssize_t lineLen;
+        count = 0;
+        t = benchNow();
+        while ((lineLen = getline(&line, &lineCap, fp)) != -1) {
+            if (lineLen > 0 && line[lineLen - 1] == '\n') line[--lineLen] = '\0';
+            if (regexec(&posix, line, 0, NULL, 0) == 0) count++;
+        }
+        t = benchNow() - t;
+        if (t < best) best = t;
+        free(line);
+        fclose(fp);
+    }
+    benchReport("regexec per line", size, best, count, "lines");
+
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        count = 0;
+        t = benchNow();
+        for (i = 0; i < (size_t)ts.nblocks; i++) {
+            rowBlock *blk = ts.blocks[i];
+            int j;
+            long len;
+            for (j = 0; j < blk->count; j++) {
+                const char *line = blockLine(blk, j, &len);
+                if (regexHits(sq.dfa, line, len, 0, len + 1, &first, &last)) count++;
+            }
+        }
+        t = benchNow() - t;
+        if (t < best) best = t;
+    }
+    benchReport("regex dfa per line", size, best, count, "lines");
+
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        count = 0;
+        t = benchNow();
+        for (i = 0; i < (size_t)ts.nblocks; i++) count += blockCountMatches(ts.blocks[i], &sq);
+        t = benchNow() - t;
+        if (t < best) best = t;
+    }
+    benchReport("regex prefiltered", size, best, count, "matches");
+
+    regfree(&posix);
+    regexDfaFree(sq.dfa);
+    regexFree(sq.re);
+    free(off);
+    munmap(map, size);
+    close(fd);
+}
+
+/**
+ * Display width of the line at s the way a terminal program does it with the
+ * C library: mbrtowc() and wcwidth() on every character.
+ */
+long benchWidthLibc(const char *s, long n) {
+    mbstate_t st;
+    long i = 0, rx = 0;
+    wchar_t wc;
+
+    memset(&st, 0, sizeof(st));
+    while (i < n) {
+        if (s[i] == '\t') {
+            rx += SMEDITOR_TAB_STOP - rx % SMEDITOR_TAB_STOP;
+            i++;
+            continue;
+        }
+        size_t len = mbrtowc(&wc, &s[i], n - i, &st);
+        if (len == (size_t)-1 || len == (size_t)-2 || len == 0) {
+            memset(&st, 0, sizeof(st));
+            rx++;
+            i++;
+            continue;
+        }
+        int w = wcwidth(wc);
+        rx += w < 0 ? 1 : w;
+        i += len;
+    }
+    return rx;
+}
+
+/**
+ * Display width of the line at s looking up every byte in the width table,
+ * without skipping plain ASCII runs.
+ */
+long benchWidthDecode(const char *s, long n) {
+    long i = 0, rx = 0;
+    int len;
+
+    while (i < n) {
+        if (s[i] == '\t') {
+            rx += SMEDITOR_TAB_STOP - rx % SMEDITOR_TAB_STOP;
+            i++;
+        } else if ((unsigned char)s[i] < 0x80) {
+            rx++;
+            i++;
+        } else {
+            rx += utf8Width(s, n, i, &len);
+            i += len;
+        }
+    }
+    return rx;
+}
+
+/**
+ * Times the display width of every line of text, and rendering every line
+ * into screen cells.
+ */
+void benchWidthText(const char *name, const char *text, size_t size) {
+    int crlf, run;
+    size_t nlines, i;
+    size_t *off = editorIndexLines(text, size, &nlines, &crlf);
+    long cols = 0;
+    double best, t;
+    struct renderSlot slot;
+    erow row;
+
+    printf("%s:\n", name);
+    if (setlocale(LC_CTYPE, "C.UTF-8") || setlocale(LC_CTYPE, "en_US.UTF-8")) {
+        best = 1e9;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            cols = 0;
+            t = benchNow();
+            for (i = 0; i < nlines; i++) {
+                size_t end = (i + 1 < nlines) ? off[i + 1] : size;
+                while (end > off[i] && (text[end - 1] == '\n' || text[end - 1] == '\r')) end--;
+                cols += benchWidthLibc(text + off[i], end - off[i]);
+            }
+            t = benchNow() - t;
+            if (t < best) best = t;
+        }
+        benchReport("  mbrtowc + wcwidth", size, best, cols, "columns");
+        setlocale(LC_CTYPE, "C");
+    }
+
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        cols = 0;
+        t = benchNow();
+        for (i = 0; i < nlines; i++) {
+            size_t end = (i + 1 < nlines) ? off[i + 1] : size;
+            while (end > off[i] && (text[end - 1] == '\n' || text[end - 1] == '\r')) end--;
+            cols += benchWidthDecode(text + off[i], end - off[i]);
+        }
+        t = benchNow() - t;
+        if (t < best) best = t;
+    }
+    benchReport("  table every byte", size, best, cols, "columns");
+
+    //the rows the editor would have, borrowing the text
+    memset(&row, 0, sizeof(row));
+    row.flags = ROW_BORROWED;
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        cols = 0;
+        t = benchNow();
+        for (i = 0; i < nlines; i++) {
+            size_t end = (i + 1 < nlines) ? off[i + 1] : size;
+            while (end > off[i] && (text[end - 1] == '\n' || text[end - 1] == '\r')) end--;
+            row.size = end - off[i];
+            rowSetChars(&row, text + off[i]);
+            cols += rowWalkRx(&row, 0, row.size, 0);
+        }
+        t = benchNow() - t;
+        if (t < best) best = t;
+    }
+    benchReport("  rowWalkRx", size, best, cols, "columns");
+
+    memset(&slot, 0, sizeof(slot));
+    best = 1e9;
+    for (run = 0; run < BENCH_RUNS; run++) {
+        cols = 0;
+        t = benchNow();
+        for (i = 0; i < nlines; i++) {
+            size_t end = (i + 1 < nlines) ? off[i + 1] : size;
+            while (end > off[i] && (text[end - 1] == '\n' || text[end - 1] == '\r')) end--;
+            row.size = end - off[i];
+            rowSetChars(&row, text + off[i]);
+            renderCacheFill(&slot, &row, 0, 80);
+            cols += slot.len;
+            //long rows leave their column index behind
+            if (row.extra) {
+                rowFree(&row);
+                row.extra = NULL;
+            }
+        }
+        t = benchNow() - t;
+        if (t < best) best = t;
+    }
+    benchReport("  renderCacheFill", size, best, cols, "cells");
+    free(slot.buf);
+    editC.rcache.bytes = 0;
+    free(off);
+}
+
+/**
+ * Column counting and rendering on the file, and on text in several scripts
+ * of about the same size: Latin with accents, Cyrillic, CJK, Hangul,
+ * combining marks and emoji.
+ */
+void benchUtf8(const char *path) {
+    static const char *mixed[] = {
+        "Grüße aus Köln, naïve café résumé\tdéjà vu",
+        "Привет, мир! Съешь же ещё этих мягких французских булок",
+        "東京都渋谷区の天気は晴れ、気温は二十度です。",
+        "안녕하세요 세계, 오늘은 좋은 날입니다",
+        "e\xCC\x81 a\xCC\x8A o\xCC\x88 combining marks\t\xF0\x9F\x98\x80 \xF0\x9F\x8E\x89 emoji",
+        "log 2024-05-01 12:00:01 INFO user=テスト status=ok 状態=正常",
+    };
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size, len = 0, k = 0;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) handleError("bench: mmap");
+
+    benchWidthText(path, map, size);
+
+    //mixed script text of the same size, capped at 256 MB
+    size_t want = size < (256 << 20) ? size : (256 << 20);
+    char *text = malloc(want + 256);
+    while (len < want) {
+        size_t n = strlen(mixed[k % 6]);
+        memcpy(text + len, mixed[k % 6], n);
+        len += n;
+        text[len++] = '\n';
+        k++;
+    }
+    benchWidthText("mixed scripts", text, len);
+    free(text);
+    munmap(map, size);
+    close(fd);
+}
+
+/**
+ * Soft wrap on the file at 80 columns: laying out every block, which is what
+ * finding a visual line would cost without the layout tree, against finding
+ * random visual lines in the tree, and paging down from the middle of the
+ * file right after a resize, which lays out only the blocks paged through.
+ */
+void benchWrap(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size, nlines;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) handleError("bench: mmap");
+    int crlf, b, i, pages = 1000;
+    size_t *off = editorIndexLines(map, size, &nlines, &crlf);
+    long total, seg, sum = 0;
+    double t;
+
+    storeAppendLazy(&editC.text, map, off, nlines, size);
+    editC.num_rows = nlines;
+    editC.screen_rows = 50;
+    editC.screen_cols = 80;
+
+    t = benchNow();
+    for (b = 0; b < editC.text.nblocks; b++) wrapLayout(&editC.text, b, 80);
+    t = benchNow() - t;
+    total = wrapBlockStart(&editC.text, editC.text.nblocks);
+    benchReport("wrap layout all", size, t, total, "lines");
+
+    srand(1);
+    t = benchNow();
+    for (i = 0; i < 1000000; i++) sum += wrapLocate(((long)rand() << 16 ^ rand()) % total, 80, &seg);
+    t = benchNow() - t;
+    printf("%-22s %8.1f ns/line  (%ld)\n", "wrap locate", t / 1e6 * 1e9, sum % 10);
+
+    //after a resize every block is stale, and only those paged through are
+    //laid out again
+    editC.screen_cols = 100;
+    editC.cy = nlines / 2;
+    editC.cx = 0;
+    t = benchNow();
+    for (i = 0; i < pages; i++) wrapMoveCursor(editC.screen_rows);
+    t = benchNow() - t;
+    printf("%-22s %8.1f us/page  at line %d\n", "wrap page down", t / pages * 1e6, editC.cy);
+
+    storeFree(&editC.text);
+    editC.num_rows = 0;
+    free(off);
+    munmap(map, size);
+    close(fd);
+}
+
+/**
+ * Line to byte offset and back on the file: summing the line lengths up to
+ * the middle of the file, as without the byte tree, against random lookups in
+ * the tree, and the same lookups right after editing one line in every block.
+ */
+void benchOffsets(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size, nlines, j;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) handleError("bench: mmap");
+    int crlf, b, i;
+    size_t *off = editorIndexLines(map, size, &nlines, &crlf);
+    long sum = 0, col, len;
+    double t;
+
+    storeAppendLazy(&editC.text, map, off, nlines, size);
+    editC.num_rows = nlines;
+
+    t = benchNow();
+    for (j = 0; j < nlines / 2; j++) {
+        b = j / ROW_BLOCK_CAP;
+        blockLine(editC.text.blocks[b], j % ROW_BLOCK_CAP, &len);
+        sum += len + 1;
+    }
+    t = benchNow() - t;
+    printf("%-22s %8.1f ms  to line %zu (%ld)\n", "offset by summing", t * 1e3, nlines / 2, sum % 10);
+
+    srand(1);
+    t = benchNow();
+    for (i = 0; i < 1000000; i++) sum += storeRowOffset(&editC.text, rand() % nlines);
+    t = benchNow() - t;
+    printf("%-22s %8.1f ns/line  (%ld)\n", "line to offset", t / 1e6 * 1e9, sum % 10);
+    t = benchNow();
+    for (i = 0; i < 1000000; i++) sum += storeOffsetRow(&editC.text, ((long)rand() << 16 ^ rand()) % size, &col);
+    t = benchNow() - t;
+    printf("%-22s %8.1f ns/line  (%ld)\n", "offset to line", t / 1e6 * 1e9, sum % 10);
+
+    for (b = 0; b < editC.text.nblocks; b++) {
+        erow *row = editorRowEdit(b * ROW_BLOCK_CAP);
+        editorRowOwn(row);
+        rowResize(row, row->size / 2);
+    }
+    t = benchNow();
+    sum += storeRowOffset(&editC.text, nlines - 1);
+    t = benchNow() - t;
+    printf("%-22s %8.1f ms  %d blocks edited\n", "offset after edits", t * 1e3, editC.text.nblocks);
+
+    storeFree(&editC.text);
+    slabFreeAll(&editC.slab);
+    editC.num_rows = 0;
+    free(off);
+    munmap(map, size);
+    close(fd);
+}
+
+/**
+ * Opening the file as the editor does, until the whole file is indexed: once
+ * with no line index cache, which scans it and writes the cache, and once
+ * with it. The cache is kept in a temporary directory.
+ */
+void benchLineCache(const char *path) {
+    char dir[] = "/tmp/smeditor-bench-XXXXXX";
+    int run;
+
+    if (mkdtemp(dir) == NULL) handleError("bench: mkdtemp");
+    setenv("XDG_CACHE_HOME", dir, 1);
+    editC.screen_rows = 50;
+    for (run = 0; run < 2; run++) {
+        double t = benchNow(), first;
+        editorOpen((char *)path);
+        first = benchNow() - t;
+        while (editorLoading()) {
+            if (!editorLoaderPoll()) usleep(100);
+        }
+        t = benchNow() - t;
+        printf("%-22s %8.1f ms  first screen %.1f ms  %d lines\n",
+               run ? "open, cached index" : "open, scanning", t * 1e3, first * 1e3, editC.num_rows);
+        storeFree(&editC.text);
+        munmap(editC.mapped.map, editC.mapped.size);
+        close(editC.mapped.fd);
+        memset(&editC.mapped, 0, sizeof(editC.mapped));
+        memset(&editC.loader, 0, sizeof(editC.loader));
+        editC.num_rows = 0;
+    }
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) fprintf(stderr, "bench: could not remove %s\n", dir);
+}
+
+void benchMemoryReport(const char *name, size_t bytes, size_t lines, double freeSecs) {
+    printf("%-22s %8.1f B/line  %10.1f MB  free %8.2f ms\n", name,
+           (double)bytes / lines, bytes / 1e6, freeSecs * 1e3);
+}
+
+/**
+ * Memory taken by the rows of the file once every line is owned, as after a
+ * replace-all that touched them all: a 48 byte erow and a malloc per line, as
+ * rows used to be kept, against the 32 byte erow with short lines inline and
+ * the rest in slabs. Also times freeing all of it.
+ */
+void benchMemory(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "bench: cannot open %s\n", path);
+        exit(1);
+    }
+    size_t size = st.st_size, nlines, i, bytes;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) handleError("bench: mmap");
+    int crlf, b;
+    size_t *off = editorIndexLines(map, size, &nlines, &crlf);
+    size_t nblocks = (nlines + ROW_BLOCK_CAP - 1) / ROW_BLOCK_CAP;
+    double t;
+
+    //the erow of before, with the text and the render state it pointed to
+    struct {
+        int size;
+        char *chars;
+        int rslot;
+        unsigned rgen;
+        unsigned char flags, hlStart, hlEnd;
+        unsigned char *hl;
+        struct colIndex *cols;
+    } *old = malloc(sizeof(*old) * nlines);
+    bytes = nblocks * (sizeof(rowBlock) + sizeof(*old) * ROW_BLOCK_CAP);
+    for (i = 0; i < nlines; i++) {
+        size_t end = (i + 1 < nlines) ? off[i + 1] : size;
+        while (end > off[i] && (map[end - 1] == '\n' || map[end - 1] == '\r')) end--;
+        old[i].size = end - off[i];
+        old[i].chars = malloc(old[i].size + 1);
+        memcpy(old[i].chars, map + off[i], old[i].size);
+        old[i].chars[old[i].size] = '\0';
+        //what the allocator hands out plus its header
+        bytes += malloc_usable_size(old[i].chars) + sizeof(size_t);
+    }
+    t = benchNow();
+    for (i = 0; i < nlines; i++) free(old[i].chars);
+    t = benchNow() - t;
+    free(old);
+    benchMemoryReport("malloc per line", bytes, nlines, t);
+
+    storeAppendLazy(&editC.text, map, off, nlines, size);
+    editC.num_rows = nlines;
+    for (i = 0; i < nlines; i++) editorRowOwn(editorRowEdit(i));
+    bytes = editC.slab.held;
+    for (b = 0; b < editC.text.nblocks; b++)
+        bytes += sizeof(rowBlock) + sizeof(erow) * ROW_BLOCK_CAP;
+    t = benchNow();
+    storeFree(&editC.text);
+    slabFreeAll(&editC.slab);
+    t = benchNow() - t;
+    editC.num_rows = 0;
+    benchMemoryReport("slabs and inline", bytes, nlines, t);
+
+    free(off);
+    munmap(map, size);
+    close(fd);
 }
 
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s FILE [NEEDLE [REGEX]]\n", argv[0]);
+        return 1;
+    }
+    benchScan(argv[1]);
+    benchSearch(argv[1], argc > 2 ? argv[2] : "needle");
+    benchRegex(argv[1], argc > 3 ? argv[3] : "need(le|ful)s?[0-9]");
+    benchUtf8(argv[1]);
+    benchWrap(argv[1]);
+    benchOffsets(argv[1]);
+    benchLineCache(argv[1]);
+    benchMemory(argv[1]);
+    return 0;
+}
+#else
 /* =============================== SMEditor ==============================*/
 int main(int argc, char *argv[]) {
+    int pipefd = -1;
+    //"smeditor -" edits whatever is piped in; keys then come from the terminal
+    if(argc >= 2 && strcmp(argv[1], "-") == 0) {
+        pipefd = editorStdinToTty();
+    }
     enableRawMode();
     initEditor();
-    if(argc >= 2) {
+    if(pipefd != -1) {
+        editorOpenFd(pipefd);
+    } else if(argc >= 2) {
         editorOpen(argv[1]);
     }
-    editorSetStatusMsg("HELP: Ctrl-S = save | Ctrk-F = find | Ctrl-Q = quit");
-    //read one byte at a time and quit reading when key pressed is 'q'
-    while (1) {
-        editorRefreshScreen();
-        editorProcessKeypress();
-    }
+    editorSetStatusMsg("HELP: ^S save | ^F find | ^R replace | ^Z/^Y undo | ^G goto | ^W wrap | ^Q quit");
+    //handle keys until Ctrl-Q; the screen is drawn by the event loop
+    //whenever no keys are waiting, see editorWaitEvent()
+    while (1) editorProcessKeypress();
     return 0;
 }
+#endif